@@ -17,6 +17,10 @@ ifneq ($(debug),y)
 FLAGS += -DNDEBUG
 endif
 
+ifeq ($(quiesce_spin),y)
+FLAGS += -DQUIESCE_SPIN
+endif
+
 FLAGS += -MMD -MF .$(@F).d
 DEPS = .*.d
 
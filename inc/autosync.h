@@ -0,0 +1,39 @@
+/*
+ * autosync.h
+ * 
+ * Streaming line-period estimator for video timing detection.
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Line period samples pass through a median-of-3 filter: One bad sample is 
+ * rejected, and a period is accepted only when two samples in the window 
+ * agree on it. The locked 
+ * period follows the filtered period only when it leaves a band of 
+ * +/-AUTOSYNC_TOL around the locked period (hysteresis).
+ * 
+ * This is independent of the hardware: Time-to-lock can be measured on a 
+ * host by replaying recorded period sequences through autosync_sample(). */
+struct autosync {
+    uint16_t win[3];    /* most recent samples */
+    uint8_t ptr;
+    uint16_t period;    /* locked line period, or 0 if not yet locked */
+    uint16_t unsettled; /* consecutive samples outside the locked band */
+    uint16_t latency;   /* samples taken by the most recent (re)lock */
+    uint32_t locks;     /* number of (re)locks */
+};
+
+#define AUTOSYNC_TOL 18 /* SYSCLK ticks (250ns) */
+
+void autosync_sample(struct autosync *a, uint16_t period);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
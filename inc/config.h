@@ -18,6 +18,8 @@ enum timings { DISP_15KHZ=0, DISP_VGA, DISP_AUTO, DISP_MAX };
 
 enum polarities { SYNC_LOW=0, SYNC_HIGH, SYNC_AUTO, SYNC_MAX };
 
+enum host_displays { HOST_LCD=0, HOST_OLED, HOST_MAX };
+
 extern struct __packed config {
 
     uint16_t polarity;
@@ -44,6 +46,15 @@ extern struct __packed config {
      * DISPCTL_enable_low  2    PA15 is Display Enable: Active LOW */
     uint16_t dispctl_mode;
 
+    /* display_2Y enum
+     * DISP_2Y_NORMAL 0    Each pixel line on one scanline
+     * DISP_2Y_DOUBLE 1    Each pixel line on two scanlines
+     * DISP_2Y_FIELD  2    Interlaced video: Alternate pixel lines in each 
+     *                     field (else as Normal) */
+#define DISP_2Y_NORMAL 0
+#define DISP_2Y_DOUBLE 1
+#define DISP_2Y_FIELD  2
+#define DISP_2Y_MAX    3
     uint16_t display_2Y;
 
     /* Mask of user-assigned pins configured in open-drain mode. */
@@ -52,7 +63,13 @@ extern struct __packed config {
     uint8_t user_pin_pushpull;
     /* Mask of user-assigned pins which are HIGH at power on. */
     uint8_t user_pin_high;
-    uint8_t _pad;
+
+    /* host_displays enum: Display emulated for the host, if not using the
+     * FF OSD custom protocol.
+     * HOST_LCD  0    HD44780 LCD via PCF8574 backpack (0x27)
+     * HOST_OLED 1    SSD1306 128x32 or 128x64 OLED (0x3c) */
+    uint8_t host_display;
+
     struct __packed config_hotkey {
         /* Mask of user pins modified by this hotkey. */
         uint8_t pin_mod;
@@ -66,6 +83,21 @@ extern struct __packed config {
 
 } config;
 
+/* Warm start: Last locked video timing, logged in the Flash page below the 
+ * config so that we can resume in that mode after power cycle. */
+struct __packed warm_start {
+    uint8_t timing;   /* index into video timing table */
+    uint8_t polarity; /* SYNC_LOW or SYNC_HIGH */
+    uint16_t period;  /* line period, SYSCLK ticks */
+    uint16_t _rsvd;
+    uint16_t crc16_ccitt;
+};
+
+bool_t warm_start_read(struct warm_start *ws);
+void warm_start_stage(const struct warm_start *ws);
+void warm_start_append(void);
+void warm_start_flush(void);
+
 extern bool_t config_active;
 extern struct display config_display;
 
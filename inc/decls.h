@@ -16,6 +16,8 @@
 
 #include "intrinsics.h"
 #include "util.h"
+#include "ring.h"
+#include "autosync.h"
 #include "stm32f10x_regs.h"
 #include "stm32f10x.h"
 
@@ -23,6 +25,7 @@
 #include "cancellation.h"
 #include "time.h"
 #include "timer.h"
+#include "sync.h"
 
 /*
  * Local variables:
@@ -0,0 +1,98 @@
+/*
+ * ring.h
+ * 
+ * Single-producer/single-consumer ring buffers.
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Ring state. Element storage is a separate array, of a power-of-two number
+ * of elements. Producer and consumer each own one free-running index. 
+ * 
+ * Producer and consumer are an IRQ (or DMA) and thread context on a single 
+ * core, so compiler barriers are sufficient: Element accesses are ordered 
+ * before the index update which hands them over. 
+ * 
+ * Elements may be produced into a ring with no space (eg. by DMA, or a 
+ * producer which cannot wait). The consumer must then resync, and such 
+ * elements are counted in @overflows. */
+struct ring {
+    uint16_t cons, prod;
+    uint16_t size;      /* number of elements (a power of two) */
+    uint16_t hwm;       /* high watermark: peak occupancy */
+    uint32_t overflows; /* elements which did not fit */
+};
+
+#define RING_INIT(arr) { .size = ARRAY_SIZE(arr) }
+
+/* Array index of free-running ring index @x. */
+static inline unsigned int ring_idx(const struct ring *r, uint16_t x)
+{
+    return x & (r->size - 1);
+}
+
+static inline unsigned int ring_used(const struct ring *r)
+{
+    return (uint16_t)(r->prod - r->cons);
+}
+
+static inline unsigned int ring_space(const struct ring *r)
+{
+    unsigned int used = ring_used(r);
+    return (used < r->size) ? r->size - used : 0;
+}
+
+/* Consumer: Find the contiguous span of elements at the consumer index. 
+ * Returns its length, and its array index in @idx. The span may be read in 
+ * place (eg. by DMA) and then released by ring_pop_commit(). */
+static inline unsigned int ring_peek(const struct ring *r, unsigned int *idx)
+{
+    unsigned int n = ring_used(r), i = ring_idx(r, r->cons);
+    barrier(); /* Read producer index /then/ elements */
+    *idx = i;
+    return min_t(unsigned int, n, r->size - i);
+}
+
+/* Consumer: Release @n elements. */
+static inline void ring_pop_commit(struct ring *r, unsigned int n)
+{
+    barrier(); /* Finish with elements /then/ release them */
+    r->cons += n;
+}
+
+/* Producer: Find the contiguous free span at the producer index. Returns 
+ * its length, and its array index in @idx. The span may be written in place 
+ * and then published by ring_push_commit(). */
+static inline unsigned int ring_reserve(const struct ring *r,
+                                        unsigned int *idx)
+{
+    unsigned int n = ring_space(r), i = ring_idx(r, r->prod);
+    *idx = i;
+    return min_t(unsigned int, n, r->size - i);
+}
+
+/* Producer: Publish @n elements. */
+void ring_push_commit(struct ring *r, unsigned int n);
+
+/* Bulk copy of up to @n elements into (out of) ring @r with storage @arr. 
+ * Elements which do not fit are dropped and counted as overflows. 
+ * Return the number of elements copied. */
+#define ring_push(r, arr, src, n) \
+    __ring_push(r, arr, src, n, sizeof((arr)[0]))
+#define ring_pop(r, arr, dst, n) \
+    __ring_pop(r, arr, dst, n, sizeof((arr)[0]))
+unsigned int __ring_push(struct ring *r, void *arr, const void *src,
+                         unsigned int n, unsigned int esz);
+unsigned int __ring_pop(struct ring *r, const void *arr, void *dst,
+                        unsigned int n, unsigned int esz);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
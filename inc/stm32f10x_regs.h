@@ -102,6 +102,34 @@ struct nvic {
 
 #define NVIC_BASE 0xe000e100
 
+/* Core debug */
+struct dbg {
+    uint32_t dhcsr;    /* 00: Debug halting control and status */
+    uint32_t dcrsr;    /* 04: Debug core register selector */
+    uint32_t dcrdr;    /* 08: Debug core register data */
+    uint32_t demcr;    /* 0C: Debug exception and monitor control */
+};
+
+#define DBG_DEMCR_TRCENA (1u<<24)
+
+#define DBG_BASE 0xe000edf0
+
+/* Data watchpoint and trace */
+struct dwt {
+    uint32_t ctrl;     /* 00: Control */
+    uint32_t cyccnt;   /* 04: Cycle count */
+    uint32_t cpicnt;   /* 08: CPI count */
+    uint32_t exccnt;   /* 0C: Exception overhead count */
+    uint32_t sleepcnt; /* 10: Sleep count */
+    uint32_t lsucnt;   /* 14: LSU count */
+    uint32_t foldcnt;  /* 18: Folded-instruction count */
+    uint32_t pcsr;     /* 1C: Program counter sample */
+};
+
+#define DWT_CTRL_CYCCNTENA (1u<<0)
+
+#define DWT_BASE 0xe0001000
+
 /* Flash memory interface */
 struct flash {
     uint32_t acr;      /* 00: Flash access control */
@@ -642,6 +670,8 @@ struct i2c {
 #define I2C_CR2_ITERREN   (1u<< 8)
 #define I2C_CR2_FREQ(x)   (x)
 
+#define I2C_OAR2_ENDUAL   (1u<< 0)
+
 #define I2C_SR1_SMBALERT  (1u<<15)
 #define I2C_SR1_TIMEOUT   (1u<<14)
 #define I2C_SR1_PECERR    (1u<<12)
@@ -0,0 +1,95 @@
+/*
+ * sync.h
+ * 
+ * Display sync: Track frames and lines from CSYNC/HSYNC and VSYNC edges.
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* CSYNC/HSYNC (A8): EXTI IRQ trigger and TIM1 Ch.1 trigger. */
+#define gpio_csync gpioa
+#define pin_csync  8
+#define irq_csync  23
+
+/* VSYNC (B14): EXTI IRQ trigger. */
+#define gpio_vsync gpiob
+#define pin_vsync  14
+#define irq_vsync  40
+
+/* Current line, counted from start of sync on the first line of the frame 
+ * (HLINE_SOF). Frames completed since the main loop last looked. */
+extern int hline, frame;
+#define HLINE_EOF -1
+#define HLINE_VBL 0
+#define HLINE_SOF 1
+
+/* Video timings. A mode is detected by its line period and number of lines 
+ * per frame (or field). The remaining fields parameterise the OSD box: 
+ * TIM1/2/4 ticks per h_off step, lines per v_off step, and for each SPI 
+ * output the SYSCLK ticks per pixel, the TIM4 lead-in before SPI data 
+ * starts, and the allowance for box lead-in and lead-out. */
+struct video_timing {
+    const char *name;
+    uint16_t min_period, max_period; /* SYSCLK ticks */
+    uint16_t min_lines, max_lines;
+    uint8_t h_scale, v_scale;
+    struct { uint8_t tpp, lead, pad; } spi[2]; /* indexed by DISP_SPIx */
+};
+
+#define TIMING_PAL   0
+#define TIMING_NTSC  1
+#define TIMING_24KHZ 2
+#define TIMING_VGA70 3
+#define TIMING_VGA60 4
+#define TIMING_MAX   5
+extern const struct video_timing video_timings[TIMING_MAX];
+
+/* Video timing for a line @period (SYSCLK ticks) and @lines per frame. */
+unsigned int timing_detect(unsigned int period, unsigned int lines);
+
+/* Line period estimator: One sample (SYSCLK ticks) per frame. */
+extern struct autosync autosync;
+
+/* Period between starts of frame, in SYSCLK ticks. */
+extern volatile uint32_t frame_cycles;
+
+/* Interlace detection: The current field, and whether fields alternate. */
+#define LACE_MAX 8
+extern bool_t odd_field;
+extern uint8_t lace;
+#define interlaced() (lace > LACE_MAX/2)
+
+/* Sync polarity detection (+ve confidence: active high). */
+#define POL_MAX    64
+#define POL_DECIDE 32
+extern bool_t pol_decided;
+extern int8_t pol_conf;
+extern uint16_t pol_latency;
+
+void set_polarity(void);
+void sync_capture_start(void);
+void line_count_stop(void);
+
+/* Sync IRQ bodies. sync_csync() returns TRUE on lines from vertical start 
+ * of the OSD box, which are left to the caller. */
+bool_t sync_csync(void);
+void sync_vsync(void);
+void sync_line_count(void);
+
+/* Called at end of OSD box. */
+void sync_frame_end(void);
+
+/* Provided by the OSD: Called at start of frame, to latch the OSD box 
+ * position (including vstart) for this frame. */
+void slave_arr_update(void);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
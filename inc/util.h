@@ -45,6 +45,7 @@ typedef char bool_t;
 void *memset(void *s, int c, size_t n);
 void *memcpy(void *dest, const void *src, size_t n);
 void *memmove(void *dest, const void *src, size_t n);
+int memcmp(const void *s1, const void *s2, size_t n);
 
 size_t strlen(const char *s);
 size_t strnlen(const char *s, size_t maxlen);
@@ -83,6 +84,10 @@ int printk(const char *format, ...)
 /* Display control */
 void display_off(void);
 
+/* User-defined glyphs (character codes 0-7, aliased at 8-15): Write one 
+ * pixel row (HD44780 CGRAM format: 5 pixels, bit 4 leftmost). */
+void font_write_cgram(unsigned int addr, uint8_t bits);
+
 /* Amiga keyboard */
 #define AMI_RETURN 0x44
 #define AMI_F(x)   (0x4f+(x))
@@ -96,6 +101,7 @@ void display_off(void);
 #define AMI_KPLEFTPAREN  0x5a
 #define AMI_KPRIGHTPAREN 0x5b
 #define AMI_KPSLASH      0x5c
+#define AMI_KPSTAR       0x5d
 #define AMI_KPPLUS       0x5e
 #define AMI_KPMINUS      0x4a
 
@@ -120,24 +126,70 @@ void console_init(void);
 void console_sync(void);
 void console_barrier(void);
 
+/* OSD pixel lines: 16-bit SPI words, MSB leftmost. Two trailing blank 
+ * words per line: In DMA-chain mode the SPI DMA is stopped at end of OSD box 
+ * rather than by an exact transfer count. */
+#define LINE_WORDS (40/2+2)
+
+/* Maximum lines in a bitmap display. */
+#define BITMAP_HEIGHT 64
+
 struct display {
     int rows, cols, on;
     uint8_t heights;
+    uint8_t dirty; /* bitmap of text rows modified since last render */
+    uint8_t shift[4]; /* per-row marquee shift left, in pixels (0-7) */
     uint8_t text[4][40];
+    /* Codes 0x00-0x0f are HD44780 CGRAM glyphs (else unprintable). */
+    bool_t user_glyphs;
+    /* Bitmap mode (if bitmap_height != 0): Pixel lines are scanned out 
+     * directly, in place of rendered text. */
+    uint8_t bitmap_height;
+    const uint16_t (*bitmap)[LINE_WORDS];
 };
 
+/* OSD text rendering: Pixel line @y of @display, as LINE_WORDS SPI words. */
+void font_init(void);
+void render_line(uint16_t *d, int y, const struct display *display);
+
 /* LCD / FF-OSD I2C Protocol. */
 void i2c_init(void);
 void i2c_process(void);
+void i2c_marquee_tick(unsigned int frames);
 extern struct display i2c_display;
 extern bool_t i2c_osd_protocol;
+extern bool_t i2c_oled; /* emulating an SSD1306 OLED? */
 extern uint8_t i2c_buttons_rx; /* Gotek -> FF_OSD */
+extern uint32_t i2c_irqs, i2c_transactions; /* statistics */
+extern uint32_t i2c_dropped_transactions, i2c_dropped_bytes;
 extern struct __packed i2c_osd_info {
     uint8_t protocol_ver;
     uint8_t fw_major, fw_minor;
     uint8_t buttons;
+    /* Receive overload statistics (protocol_ver >= 4). */
+    uint16_t dropped_transactions, dropped_bytes;
+    uint16_t peak_bytes; /* peak data ring occupancy */
 } i2c_osd_info;
 
+/* Telemetry, updated by the main loop. Served over I2C immediately after 
+ * i2c_osd_info in the register map (protocol_ver >= 5). */
+extern struct __packed i2c_osd_status {
+    uint16_t line_hz;      /* measured line frequency */
+    uint16_t frame_chz;    /* measured frame rate, in 0.01Hz units */
+    uint8_t flags;         /* OSD_STATUS_* */
+    uint8_t display_timing; /* index of the running video timing */
+    uint16_t irq_load;     /* sync IRQ CPU load, in 0.1% units */
+    uint32_t frames;       /* frames generated */
+    uint32_t sync_losses;
+    /* Polarity detection (protocol_ver >= 6). */
+    int8_t polarity_conf;      /* confidence: +ve active high */
+    uint16_t polarity_latency; /* sync edges to last decision */
+} i2c_osd_status;
+#define OSD_STATUS_LOCKED    (1u<<0) /* sync present */
+#define OSD_STATUS_POL_HIGH  (1u<<1) /* active-high sync */
+#define OSD_STATUS_DMA_CHAIN (1u<<2) /* OSD box generated by DMA chain */
+#define OSD_STATUS_INTERLACE (1u<<3) /* interlaced video (protocol_ver >= 7) */
+
 /* Build info. */
 extern const char fw_ver[];
 
@@ -152,6 +204,7 @@ extern uint32_t _irq_stacktop[], _irq_stackbottom[];
 
 /* IRQ priorities, 0 (highest) to 15 (lowest). */
 #define SYNC_IRQ_PRI          2
+#define RENDER_IRQ_PRI        3
 #define I2C_IRQ_PRI           4
 #define AMIKBD_IRQ_PRI        5
 #define TIMER_IRQ_PRI         8
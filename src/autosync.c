@@ -0,0 +1,64 @@
+/*
+ * autosync.c
+ * 
+ * Streaming line-period estimator for video timing detection.
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+static uint16_t median3(uint16_t a, uint16_t b, uint16_t c)
+{
+    return max_t(uint16_t, min_t(uint16_t, a, b),
+                 min_t(uint16_t, max_t(uint16_t, a, b), c));
+}
+
+static uint16_t period_diff(uint16_t a, uint16_t b)
+{
+    return (a > b) ? a - b : b - a;
+}
+
+/* Feed a line period sample (in IRQ context, once per frame). */
+void autosync_sample(struct autosync *a, uint16_t period)
+{
+    uint16_t m;
+    unsigned int i, agree = 0;
+
+    a->win[a->ptr] = period;
+    if (++a->ptr >= ARRAY_SIZE(a->win))
+        a->ptr = 0;
+
+    /* Time-to-lock counts from the first sample outside the locked band. */
+    if (period_diff(period, a->period) > AUTOSYNC_TOL)
+        a->unsettled++;
+    else
+        a->unsettled = 0;
+
+    /* Filtered period is zero until the window holds two samples. */
+    m = median3(a->win[0], a->win[1], a->win[2]);
+    if (!m || (period_diff(m, a->period) <= AUTOSYNC_TOL))
+        return;
+
+    /* The median alone may be a torn sample between the old and new 
+     * periods: A second sample must agree with it. */
+    for (i = 0; i < ARRAY_SIZE(a->win); i++)
+        if (period_diff(a->win[i], m) <= AUTOSYNC_TOL)
+            agree++;
+    if (agree < 2)
+        return;
+
+    a->period = m;
+    a->latency = a->unsettled;
+    a->unsettled = 0;
+    a->locks++;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
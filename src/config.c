@@ -20,7 +20,7 @@ struct config config;
 
 extern void setup_spi(uint16_t video_mode);
 extern uint16_t running_polarity;
-extern uint16_t running_display_timing;
+extern const char *running_timing_name;
 
 const static char *dispen_pretty[] = { "None", "PA15 Act.HIGH", "PA15 Act.LOW" };
 /* PB15 is tristate outside OSD; PA15 unused
@@ -29,18 +29,23 @@ const static char *dispen_pretty[] = { "None", "PA15 Act.HIGH", "PA15 Act.LOW" }
 
 const static char *timing_pretty[] = { "15kHz", "VGA", "Auto" };
 
+const static char *height_pretty[] = { "Normal", "Double", "Interlace" };
+
 const static char *polarity_pretty[] = { "Low", "High", "Auto" };
 
+const static char *host_display_pretty[] = { "LCD", "OLED" };
+
 static void config_printk(const struct config *conf)
 {
     printk("\nCurrent config:\n");
     printk(" Sync Polarity: %s\n", polarity_pretty[conf->polarity]);
     printk(" Pixel Timing: %s\n", timing_pretty[config.display_timing]);
-    printk(" Display Height: %s\n", conf->display_2Y ? "Double" : "Normal");
+    printk(" Display Height: %s\n", height_pretty[conf->display_2Y]);
     printk(" Display Output: %s\n", config.display_spi ? "PA7/SPI1" : "PB15/SPI2");
     printk(" Display Enable: %s\n", dispen_pretty[config.dispctl_mode] );
     printk(" H.Off: %u\n", conf->h_off);
     printk(" V.Off: %u\n", conf->v_off);
+    printk(" Host Display: %s\n", host_display_pretty[conf->host_display]);
     printk(" Rows: %u\n", conf->rows);
     printk(" Columns: %u-%u\n", conf->min_cols, conf->max_cols);
 }
@@ -52,11 +57,97 @@ static void config_write_flash(struct config *conf)
     fpec_init();
     fpec_page_erase((uint32_t)flash_config);
     fpec_write(conf, sizeof(*conf), (uint32_t)flash_config);
+
+    /* Flash is being written anyway: Now is a good time. */
+    warm_start_flush();
+}
+
+/* Warm-start records are appended to their own page, which is erased only 
+ * when full. The last record with a good CRC is the current one. A new 
+ * record is staged in RAM and appended outside the OSD box: Programming 8 
+ * bytes stalls the CPU for a few hundred microseconds. A page erase stalls 
+ * it for tens of milliseconds, so is done only at a quiet point, and a full 
+ * page is erased ahead of the next append. */
+const static struct warm_start *flash_warm = (struct warm_start *)0x0800f800;
+#define NR_WARM (FLASH_PAGE_SIZE / sizeof(struct warm_start))
+static struct warm_start warm_staged;
+static bool_t warm_dirty;
+
+static bool_t warm_erased(const struct warm_start *ws)
+{
+    const uint8_t *p = (const uint8_t *)ws;
+    unsigned int i;
+    for (i = 0; i < sizeof(*ws); i++)
+        if (p[i] != 0xff)
+            return FALSE;
+    return TRUE;
+}
+
+/* Index of the first free record (NR_WARM if the page is full). */
+static unsigned int warm_free(void)
+{
+    unsigned int i;
+    for (i = 0; (i < NR_WARM) && !warm_erased(&flash_warm[i]); i++)
+        continue;
+    return i;
+}
+
+bool_t warm_start_read(struct warm_start *ws)
+{
+    unsigned int i;
+    bool_t found = FALSE;
+    for (i = 0; (i < NR_WARM) && !warm_erased(&flash_warm[i]); i++) {
+        if (crc16_ccitt(&flash_warm[i], sizeof(*ws), 0xffff))
+            continue;
+        *ws = flash_warm[i];
+        found = TRUE;
+    }
+    return found;
+}
+
+void warm_start_stage(const struct warm_start *ws)
+{
+    warm_staged = *ws;
+    warm_dirty = TRUE;
+}
+
+/* Append the staged record, if any. It stays staged while the page is full 
+ * (erase pending). Call only outside the OSD box. */
+void warm_start_append(void)
+{
+    struct warm_start *ws = &warm_staged;
+    unsigned int i;
+
+    if (!warm_dirty || ((i = warm_free()) == NR_WARM))
+        return;
+    warm_dirty = FALSE;
+
+    ws->_rsvd = 0;
+    ws->crc16_ccitt = htobe16(
+        crc16_ccitt(ws, sizeof(*ws)-2, 0xffff));
+    fpec_init();
+    fpec_write(ws, sizeof(*ws), (uint32_t)&flash_warm[i]);
+}
+
+/* Erase a full page, carrying over its current record unless a newer one 
+ * is staged, then append. Call only while no OSD is generated. */
+void warm_start_flush(void)
+{
+    struct warm_start ws;
+
+    if (warm_free() == NR_WARM) {
+        if (!warm_dirty && warm_start_read(&ws))
+            warm_start_stage(&ws);
+        fpec_init();
+        fpec_page_erase((uint32_t)flash_warm);
+    }
+
+    warm_start_append();
 }
 
 static void lcd_display_update(void)
 {
-    if (i2c_osd_protocol)
+    if (i2c_osd_protocol || i2c_oled)
         return;
     i2c_display.rows = config.rows;
     i2c_display.cols = config.min_cols;
@@ -106,6 +197,7 @@ static enum {
     C_h_off,
     C_v_off,
     /* LCD */
+    C_hostdisp,
     C_rows,
     C_min_cols,
     C_max_cols,
@@ -120,6 +212,7 @@ static void cnf_prt(int row, const char *format, ...)
     char *r = (char *)config_display.text[row];
 
     memset(r, 0, 20);
+    config_display.dirty |= 1u << row;
 
     va_start(ap, format);
     (void)vsnprintf(r, 20, format, ap);
@@ -210,10 +303,14 @@ void config_process(uint8_t b)
             config_printk(&config);
             lcd_display_update();
         }
-        if ((config_state == C_rows) && i2c_osd_protocol) {
+        if ((config_state == C_hostdisp) && i2c_osd_protocol) {
             /* Skip LCD config options if using the extended OSD protocol. */
             config_state = C_save;
         }
+        if ((config_state == C_rows) && (config.host_display == HOST_OLED)) {
+            /* Rows and columns are fixed for an OLED. */
+            config_state = C_save;
+        }
         config_active = (config_state != C_idle);
         changed = TRUE;
     }
@@ -271,7 +368,7 @@ void config_process(uint8_t b)
         }
         if (b) {
             if (config.display_timing == DISP_AUTO)
-                cnf_prt(1, "%s (%s)", timing_pretty[config.display_timing], timing_pretty[running_display_timing]);
+                cnf_prt(1, "%s (%s)", timing_pretty[config.display_timing], running_timing_name);
             else
                 cnf_prt(1, "%s", timing_pretty[config.display_timing]);
         }
@@ -280,10 +377,11 @@ void config_process(uint8_t b)
         if (changed)
             cnf_prt(0, "Display Height:");
         if (b & (B_LEFT|B_RIGHT)) {
-            config.display_2Y ^= 1;
+            if (++config.display_2Y >= DISP_2Y_MAX)
+                config.display_2Y = 0;
         }
         if (b)
-            cnf_prt(1, "%s", config.display_2Y ? "Double" : "Normal");
+            cnf_prt(1, "%s", height_pretty[config.display_2Y]);
         break;
     case C_spibus:
         if (changed)
@@ -329,6 +427,14 @@ void config_process(uint8_t b)
         if (b)
             cnf_prt(1, "%u", config.v_off);
         break;
+    case C_hostdisp:
+        if (changed)
+            cnf_prt(0, "Host Display:");
+        if (b & (B_LEFT|B_RIGHT))
+            config.host_display ^= 1;
+        if (b)
+            cnf_prt(1, "%s", host_display_pretty[config.host_display]);
+        break;
     case C_rows:
         if (changed)
             cnf_prt(0, "Rows (2 or 4):");
@@ -368,7 +474,8 @@ void config_process(uint8_t b)
         if (changed) {
             cnf_prt(0, "Save New Config?");
             if ((old_config.display_spi == config.display_spi)
-             && (old_config.dispctl_mode == config.dispctl_mode) )
+             && (old_config.dispctl_mode == config.dispctl_mode)
+             && (old_config.host_display == config.host_display) )
                 new_config = C_SAVE;
             else
                 new_config = C_SAVEREBOOT;
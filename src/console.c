@@ -18,9 +18,9 @@ void IRQ_14(void) __attribute__((alias("IRQ_dma1_ch4_tc")));
 
 /* We stage serial output in a ring buffer. DMA occurs from the ring buffer;
  * the consumer index being updated each time a DMA sequence completes. */
-static char ring[2048];
-#define MASK(x) ((x)&(sizeof(ring)-1))
-static unsigned int cons, prod, dma_sz;
+static char tx_buf[2048];
+static struct ring tx_ring = RING_INIT(tx_buf);
+static unsigned int dma_sz;
 
 /* The console can be set into synchronous mode in which case DMA is disabled 
  * and the transmit-empty flag is polled manually for each byte. */
@@ -28,18 +28,21 @@ static bool_t sync_console;
 
 static void kick_tx(void)
 {
+    unsigned int i;
+
     if (sync_console) {
 
-        while (cons != prod) {
+        while (ring_peek(&tx_ring, &i)) {
             while (!(usart1->sr & USART_SR_TXE))
                 cpu_relax();
-            usart1->dr = ring[MASK(cons++)];
+            usart1->dr = tx_buf[i];
+            ring_pop_commit(&tx_ring, 1);
         }
 
-    } else if (!dma_sz && (cons != prod)) {
+    } else if (!dma_sz && ((dma_sz = ring_peek(&tx_ring, &i)) != 0)) {
 
-        dma_sz = min(MASK(prod-cons), sizeof(ring)-MASK(cons));
-        dma1->ch4.cmar = (uint32_t)(unsigned long)&ring[MASK(cons)];
+        /* DMA straight out of the ring. */
+        dma1->ch4.cmar = (uint32_t)(unsigned long)&tx_buf[i];
         dma1->ch4.cndtr = dma_sz;
         dma1->ch4.ccr = (DMA_CCR_MSIZE_8BIT |
                          /* The manual doesn't allow byte accesses to usart. */
@@ -59,7 +62,7 @@ static void IRQ_dma1_ch4_tc(void)
     dma1->ifcr = DMA_IFCR_CGIF(4);
 
     /* Update ring state. */
-    cons += dma_sz;
+    ring_pop_commit(&tx_ring, dma_sz);
     dma_sz = 0;
 
     /* Kick off more transmit activity. */
@@ -77,16 +80,17 @@ int vprintk(const char *format, va_list ap)
 
     n = vsnprintf(str, sizeof(str), format, ap);
 
+    /* Output that does not fit in the ring is dropped (and counted). */
     p = str;
-    while (((c = *p++) != '\0') && ((prod-cons) != (sizeof(ring) - 1))) {
+    while ((c = *p++) != '\0') {
         switch (c) {
         case '\r': /* CR: ignore as we generate our own CR/LF */
             break;
         case '\n': /* LF: convert to CR/LF (usual terminal behaviour) */
-            ring[MASK(prod++)] = '\r';
+            ring_push(&tx_ring, tx_buf, "\r", 1);
             /* fall through */
         default:
-            ring[MASK(prod++)] = c;
+            ring_push(&tx_ring, tx_buf, &c, 1);
             break;
         }
     }
@@ -129,8 +133,8 @@ void console_sync(void)
 
 void console_barrier(void)
 {
-    unsigned int p = prod;
-    while (p != cons)
+    uint16_t p = tx_ring.prod;
+    while (p != tx_ring.cons)
         cpu_relax();
 }
 
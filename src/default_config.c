@@ -21,6 +21,7 @@ const static struct config dfl_config = {
     .display_timing = DISP_15KHZ,
     .display_spi = DISP_SPI2,
     .display_2Y = FALSE,
+    .host_display = HOST_LCD,
 
 #define F(x) (x-1)   /* Hotkey (F1-F10) array index */
 #define U(x) (1u<<x) /* User pin (U0-U2) bitmask */
@@ -4,6 +4,9 @@
  * I2C communications to the host:
  *  1. Emulate HD44780 LCD controller via a PCF8574 I2C backpack.
  *  2. Support extended custom protocol with bidirectional comms.
+ *  3. Emulate SSD1306 OLED controller (128x32 or 128x64).
+ * The custom protocol (address 0x10) is always served, alongside either the 
+ * LCD (0x27) or the OLED (0x3c) according to config.
  * 
  * Written & released by Keir Fraser <keir.xen@gmail.com>
  * 
@@ -21,8 +24,36 @@
 #define _RW (1u<<1)
 #define _RS (1u<<0)
 
-/* Current position in FF OSD I2C Protocol character data. */
+/* Current position in FF OSD I2C Protocol character data, number of 
+ * character data bytes still expected, and the command they belong to. */
 static uint8_t ff_osd_x, ff_osd_y;
+static uint16_t ff_osd_run;
+static uint8_t ff_osd_sink;
+
+/* FF OSD I2C Protocol command awaiting argument bytes. */
+static uint8_t ff_osd_cmd, ff_osd_argc, ff_osd_args[4];
+
+
+/* Marquee: A text row scrolled on-device, pixel by pixel, through a virtual
+ * line which may be longer than the display. The line wraps around. */
+#define MARQUEE_MAX 128
+struct marquee {
+    uint8_t len;   /* virtual line length (0 = row not scrolled) */
+    uint8_t speed; /* frames per pixel step */
+    uint8_t text[MARQUEE_MAX];
+};
+static struct marquee mq_stage[4], mq[4];
+static uint16_t mq_pos[4]; /* pixel offset into virtual line */
+static uint8_t mq_ticks[4]; /* frames since last step */
+static struct marquee *ff_osd_mq; /* receiving OSD_MARQUEE data */
+
+/* Bitmap mode: Pixels written by OSD_BLIT, and scanned out directly. */
+static uint16_t i2c_bitmap[BITMAP_HEIGHT][LINE_WORDS];
+
+/* OSD_BLIT stage: A pixel line is copied from i2c_bitmap when a transaction 
+ * first writes it, and copied back when the transaction commits. */
+static uint16_t ff_osd_bitmap[BITMAP_HEIGHT][LINE_WORDS];
+static uint64_t ff_osd_bitmap_dirty; /* staged pixel lines */
 
 /* STM32 I2C peripheral. */
 #define i2c i2c1
@@ -37,26 +68,101 @@ void IRQ_32(void) __attribute__((alias("IRQ_i2c_error")));
 #define I2C_EVENT_IRQ 31
 void IRQ_31(void) __attribute__((alias("IRQ_i2c_event")));
 
-/* I2C data ring. */
-static uint8_t d_ring[1024];
-static uint16_t d_cons, d_prod;
-#define MASK(r,x) ((x) & (ARRAY_SIZE(r)-1))
+/* I2C RX DMA: Received bytes go straight into the data ring. */
+#define i2c_rx_dma (dma1->ch7)
+
+/* I2C RX DMA half- and full-transfer ISR: Counts data ring halves filled. */
+#define I2C_RX_DMA_IRQ 17
+void IRQ_17(void) __attribute__((alias("IRQ_i2c_rx_dma")));
 
-/* Transaction ring: Data-ring offset of each transaction start. */
-static uint16_t t_ring[8];
-static uint16_t t_cons, t_prod;
+/* I2C data ring: Filled by circular DMA. The producer index is brought up 
+ * to date from the DMA position by d_prod_update(), in thread context. */
+static uint8_t d_buf[1024];
+static struct ring d_ring = RING_INIT(d_buf);
 
-/* Display state, exported to display routines. */
+/* Half-ring boundaries passed by the RX DMA (counted by IRQ_i2c_rx_dma), and
+ * by the data ring's producer index. */
+static volatile uint16_t d_halves;
+static uint16_t d_prod_halves;
+
+/* Transaction ring: Data-ring position (masked) of each transaction start, 
+ * tagged with the own address it was sent to. */
+static uint16_t t_buf[32];
+static struct ring t_ring = RING_INIT(t_buf);
+#define T_OAR2 0x8000 /* sent to OAR2 (LCD/OLED), else OAR1 (FF OSD) */
+
+/* Protocol of the transaction currently being processed. */
+static uint8_t rx_proto;
+#define RX_NONE    0 /* discarding, until the next transaction */
+#define RX_OSD     1 /* FF OSD protocol */
+#define RX_DISPLAY 2 /* emulated LCD or OLED */
+
+/* Number of completed (STOP or repeated START) receive transactions. */
+static uint16_t t_done;
+
+/* Statistics: I2C IRQs taken, and receive transactions. Transactions and 
+ * bytes dropped under receive overload. */
+uint32_t i2c_irqs, i2c_transactions;
+uint32_t i2c_dropped_transactions, i2c_dropped_bytes;
+
+/* Display state, exported to display routines. Shared by the FF OSD host 
+ * and the LCD/OLED host: If both are active, the last writer wins. An FF OSD
+ * commit replaces the whole display, and LCD/OLED writes then land on top 
+ * of it. */
 struct display i2c_display;
 
+/* FF OSD protocol: Transactions are decoded into a staging display, which 
+ * is committed to i2c_display only when a transaction completes. The 
+ * display routines therefore never see a partially-updated screen. A copy 
+ * of the last committed stage is kept, so that a partial transaction can 
+ * be dropped. */
+static struct display ff_osd_stage, ff_osd_committed;
+static bool_t ff_osd_staged;
+
 /* LCD state. */
 static bool_t lcd_inc;
 static uint8_t lcd_ddraddr;
+static bool_t lcd_cgram; /* data writes go to CGRAM (else DDRAM)? */
+static uint8_t lcd_cgaddr;
+
+/* OLED state: A shadow of SSD1306 GDDRAM (8 pages of 128 column bytes, LSB 
+ * at top), with a bitmap of dirty 8-column blocks per page. Dirty blocks are 
+ * transposed into i2c_bitmap once the data ring is drained. */
+bool_t i2c_oled;
+static uint8_t oled_ram[8][128];
+static uint16_t oled_dirty[8];
+static struct {
+    bool_t ctl;      /* next byte is a control byte */
+    bool_t data;     /* D/C#: bytes are GDDRAM data (else commands) */
+    bool_t single;   /* Co: one byte, then another control byte */
+    uint8_t cmd, argc, nr_args, args[6];
+    uint8_t mode;    /* addressing mode: 0=horizontal, 1=vertical, 2=page */
+    uint8_t col, col_start, col_end;
+    uint8_t page, page_start, page_end;
+    uint8_t height;  /* multiplex ratio (lines displayed) */
+    uint8_t start_line;
+    bool_t seg_remap, com_dec, invert;
+} oled;
 
 /* I2C custom protocol state. */
-bool_t i2c_osd_protocol; /* using the custom protocol? */
+bool_t i2c_osd_protocol; /* custom protocol command received? */
 uint8_t i2c_buttons_rx; /* button state: Gotek -> OSD */
 struct i2c_osd_info i2c_osd_info; /* state: OSD -> Gotek */
+struct i2c_osd_status i2c_osd_status; /* telemetry: OSD -> Gotek */
+
+/* Register map: Double-buffered snapshots of i2c_osd_info followed by 
+ * i2c_osd_status. A read is served entirely from the snapshot published when 
+ * it started, and thread context never rewrites a snapshot which is being 
+ * read, so reads never tear. */
+static struct __packed i2c_osd_regs {
+    struct i2c_osd_info info;
+    struct i2c_osd_status status;
+} regs[2];
+static volatile uint8_t regs_pub; /* latest snapshot */
+static volatile uint8_t regs_rd = 0xff; /* snapshot being read, or 0xff */
+static uint8_t regs_ptr; /* register offset for the next read */
+
+static void rx_done(void);
 
 /* I2C Error ISR: As slave with clock stretch we can only receive:
  *  Bus error (BERR): Peripheral automatically recovers
@@ -65,19 +171,49 @@ static void IRQ_i2c_error(void)
 {
     /* Clear I2C errors. Nothing else needs to be done. */
     i2c->sr1 &= ~I2C_SR1_ERRORS;
+    i2c_irqs++;
 }
 
+/* I2C Event ISR: Received data is moved by DMA, so in receive mode we see 
+ * only ADDR and STOPF. Transmit (OSD -> Gotek info) is by TXE interrupt. */
 static void IRQ_i2c_event(void)
 {
     static uint8_t rp;
-    uint16_t sr1 = i2c->sr1;
+    static bool_t rx_active;
+    uint16_t cr2, sr2, sr1 = i2c->sr1;
+
+    i2c_irqs++;
 
     if (sr1 & I2C_SR1_ADDR) {
+        /* DMA requests off before ADDR is cleared: In transmit mode TXE 
+         * would request I2C1_TX on DMA1 Ch.6, which drives the OSD box. */
+        cr2 = i2c->cr2 & ~(I2C_CR2_DMAEN | I2C_CR2_ITBUFEN);
+        i2c->cr2 = cr2;
         /* Read SR2 clears SR1_ADDR. */
-        uint16_t sr2 = i2c->sr2;
-        if (!(sr2 & I2C_SR2_TRA))
-            t_ring[MASK(t_ring, t_prod++)] = d_prod;
-        rp = 0;
+        sr2 = i2c->sr2;
+        if (rx_active) {
+            /* Repeated START ends the previous receive transaction. */
+            rx_done();
+            rx_active = FALSE;
+        }
+        if (!(sr2 & I2C_SR2_TRA)) {
+            /* Clock is stretched until ADDR is cleared, so the DMA position 
+             * is exactly the start of this transaction's data. */
+            t_buf[ring_idx(&t_ring, t_ring.prod)] =
+                ring_idx(&d_ring, d_ring.size - i2c_rx_dma.cndtr)
+                | ((sr2 & I2C_SR2_DUALF) ? T_OAR2 : 0);
+            ring_push_commit(&t_ring, 1);
+            i2c->cr2 = cr2 | I2C_CR2_DMAEN;
+            rx_active = TRUE;
+            i2c_transactions++;
+            regs_rd = 0xff;
+        } else {
+            /* Read: Serve the latest snapshot, from the register pointer. */
+            regs_rd = regs_pub;
+            rp = regs_ptr;
+            regs_ptr = 0;
+            i2c->cr2 = cr2 | I2C_CR2_ITBUFEN;
+        }
     }
 
     if (sr1 & I2C_SR1_STOPF) {
@@ -85,121 +221,407 @@ static void IRQ_i2c_event(void)
         i2c->cr1 = I2C_CR1_ACK | I2C_CR1_PE;
     }
 
-    if (sr1 & I2C_SR1_RXNE) {
-        /* Read DR clears SR1_RXNE. */
-        d_ring[MASK(d_ring, d_prod++)] = i2c->dr;
-    }
-
     if (sr1 & I2C_SR1_TXE) {
         /* Write DR clears SR1_TXE. */
-        uint8_t *info = (uint8_t *)&i2c_osd_info;
-        i2c->dr = (rp < sizeof(i2c_osd_info)) ? info[rp++] : 0;
+        uint8_t *r = (uint8_t *)&regs[regs_rd & 1];
+        i2c->dr = ((regs_rd < 2) && (rp < sizeof(regs[0]))) ? r[rp++] : 0;
     }
+
+    /* STOP ends a receive transaction. Its final byte was moved by DMA as 
+     * soon as it was received, well before the STOP condition. */
+    if ((sr1 & I2C_SR1_STOPF) && rx_active) {
+        rx_done();
+        rx_active = FALSE;
+    }
+
+    if (sr1 & I2C_SR1_STOPF)
+        regs_rd = 0xff;
+}
+
+static void IRQ_i2c_rx_dma(void)
+{
+    uint32_t isr = dma1->isr;
+
+    /* Clear only the flags we count: Another may be set meanwhile. */
+    dma1->ifcr = isr & (DMA_IFCR_CHTIF(7) | DMA_IFCR_CTCIF(7));
+    d_halves += !!(isr & DMA_ISR_HTIF(7)) + !!(isr & DMA_ISR_TCIF(7));
+}
+
+/* Bring the data ring's producer index up to date with the RX DMA position.
+ * The position alone cannot show that the DMA has lapped the producer (if 
+ * we are held off for a whole ring of data): Its half-ring boundaries are 
+ * counted too. Returns the number of whole laps missed. */
+static unsigned int d_prod_update(void)
+{
+    uint16_t halves, pos, i, n, half = d_ring.size/2;
+    int16_t extra;
+
+    halves = d_halves;
+    barrier(); /* Get boundaries passed /then/ DMA position */
+    pos = d_ring.size - i2c_rx_dma.cndtr;
+    i = ring_idx(&d_ring, d_ring.prod);
+    n = ring_idx(&d_ring, pos - i);
+    ring_push_commit(&d_ring, n);
+
+    /* Boundaries passed beyond those we can see in the position. The IRQ 
+     * may lag the position by one boundary. */
+    d_prod_halves += (i + n) / half - i / half;
+    extra = halves - d_prod_halves;
+    if (extra < 2)
+        return 0;
+    d_prod_halves += extra & ~1;
+    return extra / 2;
 }
 
 /* FF OSD command set */
 #define OSD_BACKLIGHT    0x00 /* [0] = backlight on */
 #define OSD_DATA         0x02 /* next columns*rows bytes are text data */
+#define OSD_WRITE        0x03 /* x, y, n; next n bytes are text data at x,y */
+#define OSD_FILL         0x04 /* x, y, n, c: n copies of c at x,y */
+#define OSD_MARQUEE      0x05 /* y, speed, n; next n bytes scroll on row y */
+#define OSD_BITMAP       0x06 /* h: bitmap mode, h lines (0 = text mode) */
+#define OSD_BLIT         0x07 /* x, y, w, h; next w*h bytes are pixels */
+#define OSD_INFO         0x08 /* r: register offset for the next read */
 #define OSD_ROWS         0x10 /* [3:0] = #rows */
 #define OSD_HEIGHTS      0x20 /* [3:0] = 1 iff row is 2x height */
 #define OSD_BUTTONS      0x30 /* [3:0] = button mask */
 #define OSD_COLUMNS      0x40 /* [6:0] = #columns */
 
-static void ff_osd_process(void)
+/* Data sink for a run which is entirely off the display: Bytes are 
+ * consumed and discarded. */
+#define OSD_DISCARD      0xff
+
+/* Protocol version advertised in i2c_osd_info. 
+ *  0: Initial command set.
+ *  1: Adds OSD_WRITE and OSD_FILL.
+ *  2: Adds OSD_MARQUEE.
+ *  3: Adds OSD_BITMAP and OSD_BLIT.
+ *  4: Adds overload statistics to i2c_osd_info.
+ *  5: Adds OSD_INFO and the i2c_osd_status telemetry registers.
+ *  6: Adds polarity detection to i2c_osd_status. 
+ *  7: Adds interlace detection to i2c_osd_status. */
+#define OSD_PROTOCOL_VER 7
+
+/* Number of argument bytes, for commands which take them. */
+static const uint8_t ff_osd_nr_args[] = {
+    [OSD_WRITE] = 3, [OSD_FILL] = 4, [OSD_MARQUEE] = 3,
+    [OSD_BITMAP] = 1, [OSD_BLIT] = 4, [OSD_INFO] = 1
+};
+
+/* End of a receive transaction (in IRQ context). A transaction consisting 
+ * only of OSD_INFO sets the register pointer here, rather than in thread 
+ * context, so that it applies to an immediately-following read. */
+static void rx_done(void)
 {
-    uint16_t d_c, d_p, t_c, t_p;
+    uint16_t s = t_buf[ring_idx(&t_ring, t_ring.prod - 1)];
+    uint16_t e = ring_idx(&d_ring, d_ring.size - i2c_rx_dma.cndtr);
 
-    d_c = d_cons;
-    d_p = d_prod;
-    barrier(); /* Get data ring producer /then/ transaction ring producer */
-    t_c = t_cons;
-    t_p = t_prod;
-
-    /* We only care about the last full transaction, and newer. */
-    if ((uint16_t)(t_p - t_c) >= 2) {
-        /* Discard older transactions, and in-progress old transaction. */
-        t_c = t_p - 2;
-        d_c = t_ring[MASK(t_ring, t_c)];
-        ff_osd_y = 0;
+    t_done++;
+    if (s & T_OAR2)
+        return;
+    if ((ring_idx(&d_ring, e - s) == 2) && (d_buf[s] == OSD_INFO))
+        regs_ptr = d_buf[ring_idx(&d_ring, s + 1)];
+}
+
+/* Publish a snapshot of the register map, unless the snapshot we would 
+ * overwrite is still being read. In that case we try again next time. */
+static void regs_publish(void)
+{
+    uint8_t w = !regs_pub;
+    if (regs_rd == w)
+        return;
+    regs[w].info = i2c_osd_info;
+    regs[w].status = i2c_osd_status;
+    barrier(); /* Write the snapshot /then/ publish it */
+    regs_pub = w;
+}
+
+/* Draw the visible window of a marquee row into i2c_display. The whole text 
+ * row is filled, so the renderer can draw in the character after the last 
+ * column. */
+static void marquee_render(unsigned int row)
+{
+    struct marquee *m = &mq[row];
+    unsigned int x, i = mq_pos[row] / 8;
+
+    for (x = 0; x < ARRAY_SIZE(i2c_display.text[row]); x++) {
+        i2c_display.text[row][x] = m->text[i];
+        if (++i >= m->len)
+            i = 0;
+    }
+    i2c_display.shift[row] = mq_pos[row] & 7;
+    i2c_display.dirty |= 1u << row;
+}
+
+/* Called from the main loop once per generated frame (@frames since the 
+ * last call). Steps each marquee row at its own rate. */
+void i2c_marquee_tick(unsigned int frames)
+{
+    struct marquee *m;
+    unsigned int row, steps;
+
+    for (row = 0; row < ARRAY_SIZE(mq); row++) {
+        m = &mq[row];
+        if (!m->len || !m->speed)
+            continue;
+        mq_ticks[row] = min_t(unsigned int, 255, mq_ticks[row] + frames);
+        if (mq_ticks[row] < m->speed)
+            continue;
+        steps = mq_ticks[row] / m->speed;
+        mq_ticks[row] %= m->speed;
+        mq_pos[row] = (mq_pos[row] + steps) % (m->len * 8);
+        marquee_render(row);
+    }
+}
+
+/* Publish the staged display, marking changed text rows dirty. This 
+ * replaces anything written by an LCD/OLED host (last writer wins). */
+static void ff_osd_commit(void)
+{
+    unsigned int row, y;
+    uint8_t dirty = i2c_display.dirty;
+    uint64_t bitmap_dirty = ff_osd_bitmap_dirty;
+
+    for (row = 0; row < ARRAY_SIZE(i2c_display.text); row++)
+        if (memcmp(i2c_display.text[row], ff_osd_stage.text[row],
+                   sizeof(i2c_display.text[row])))
+            dirty |= 1u << row;
+
+    /* Text last written by the LCD host was drawn with its CGRAM glyphs. */
+    if (i2c_display.user_glyphs)
+        dirty = 0xff;
+
+    i2c_display = ff_osd_committed = ff_osd_stage;
+    i2c_display.dirty = dirty;
+    ff_osd_staged = FALSE;
+
+    for (y = 0; bitmap_dirty != 0; y++, bitmap_dirty >>= 1)
+        if (bitmap_dirty & 1)
+            memcpy(i2c_bitmap[y], ff_osd_bitmap[y], sizeof(i2c_bitmap[y]));
+    ff_osd_bitmap_dirty = 0;
+
+    /* Marquee rows override the staged text. A changed marquee restarts 
+     * from its first character. */
+    for (row = 0; row < ARRAY_SIZE(mq); row++) {
+        if (memcmp(&mq[row], &mq_stage[row], sizeof(mq[row]))) {
+            mq[row] = mq_stage[row];
+            mq_pos[row] = mq_ticks[row] = 0;
+        }
+        if (mq[row].len)
+            marquee_render(row);
+    }
+}
+
+/* Discard the staged (partially decoded) transaction: The stage reverts to 
+ * the last commit. */
+static void ff_osd_drop(void)
+{
+    if (!ff_osd_staged)
+        return;
+    ff_osd_stage = ff_osd_committed;
+    memcpy(mq_stage, mq, sizeof(mq_stage));
+    ff_osd_bitmap_dirty = 0;
+    ff_osd_run = ff_osd_cmd = 0;
+    ff_osd_staged = FALSE;
+}
+
+/* Write a character at the current position and advance. Characters 
+ * outside the display are discarded. */
+static void ff_osd_putc(uint8_t c)
+{
+    if ((ff_osd_y < ff_osd_stage.rows) && (ff_osd_x < ff_osd_stage.cols))
+        ff_osd_stage.text[ff_osd_y][ff_osd_x] = c;
+    if (++ff_osd_x >= ff_osd_stage.cols) {
+        ff_osd_x = 0;
+        ff_osd_y++;
+    }
+}
+
+/* Write a byte of pixels (MSB leftmost) into bitmap @bm. @x is in bytes 
+ * (8 pixels). Pixels outside the bitmap are discarded. */
+static void bitmap_write(uint16_t (*bm)[LINE_WORDS], unsigned int x,
+                         unsigned int y, uint8_t b)
+{
+    uint16_t *p;
+
+    if ((x >= 2*(LINE_WORDS-2)) || (y >= BITMAP_HEIGHT))
+        return;
+    p = &bm[y][x/2];
+    *p = (x & 1) ? (*p & 0xff00) | b : (*p & 0x00ff) | (b << 8);
+}
+
+/* Write a byte of pixels at the current position in the OSD_BLIT rectangle
+ * and advance. The rectangle's x coordinate and width are in bytes. */
+static void ff_osd_blit(uint8_t b)
+{
+    uint8_t *a = ff_osd_args; /* x, y, w, h */
+    unsigned int y = a[1] + ff_osd_y;
+
+    if ((y < BITMAP_HEIGHT) && !(ff_osd_bitmap_dirty & (1ull << y))) {
+        memcpy(ff_osd_bitmap[y], i2c_bitmap[y], sizeof(ff_osd_bitmap[y]));
+        ff_osd_bitmap_dirty |= 1ull << y;
     }
+    bitmap_write(ff_osd_bitmap, a[0] + ff_osd_x, y, b);
+    if (++ff_osd_x >= a[2]) {
+        ff_osd_x = 0;
+        ff_osd_y++;
+    }
+}
+
+/* Execute a command with all its argument bytes received. */
+static void ff_osd_exec(void)
+{
+    uint8_t *a = ff_osd_args;
+    unsigned int n;
 
-    /* Data ring should not be more than half full. We don't want it to 
-     * overrun during the processing loop below: That should be impossible
-     * with half a ring free. */
-    ASSERT((uint16_t)(d_p - d_c) < (ARRAY_SIZE(d_ring)/2));
-
-    /* Process the command sequence. */
-    for (; d_c != d_p; d_c++) {
-        uint8_t x = d_ring[MASK(d_ring, d_c)];
-        if ((t_c != t_p) && (d_c == t_ring[MASK(t_ring, t_c)])) {
-            t_c++;
-            ff_osd_y = 0;
+    ff_osd_x = a[0];
+    ff_osd_y = a[1];
+    ff_osd_sink = ff_osd_cmd;
+    switch (ff_osd_cmd) {
+    case OSD_MARQUEE:
+        ff_osd_run = a[2];
+        if (a[0] >= ARRAY_SIZE(mq_stage)) {
+            /* Bad row: Discard the text. */
+            ff_osd_sink = OSD_DISCARD;
+            break;
         }
-        if (ff_osd_y != 0) {
-            /* Character Data. */
-            i2c_display.text[ff_osd_y-1][ff_osd_x] = x;
-            if (++ff_osd_x >= i2c_display.cols) {
-                ff_osd_x = 0;
-                if (++ff_osd_y > i2c_display.rows)
-                    ff_osd_y = 0;
+        ff_osd_mq = &mq_stage[a[0]];
+        memset(ff_osd_mq, ' ', sizeof(*ff_osd_mq));
+        ff_osd_mq->speed = a[1];
+        ff_osd_mq->len = min_t(uint8_t, a[2], MARQUEE_MAX);
+        ff_osd_x = 0;
+        break;
+    case OSD_WRITE:
+        ff_osd_run = a[2];
+        /* Runs wrap at the column count, but only from a start cell on 
+         * the display. Else the whole run is clipped. */
+        if ((ff_osd_x >= ff_osd_stage.cols) || (ff_osd_y >= ff_osd_stage.rows))
+            ff_osd_sink = OSD_DISCARD;
+        break;
+    case OSD_FILL:
+        if ((ff_osd_x >= ff_osd_stage.cols) || (ff_osd_y >= ff_osd_stage.rows))
+            break;
+        for (n = a[2]; n && (ff_osd_y < ff_osd_stage.rows); n--)
+            ff_osd_putc(a[3]);
+        break;
+    case OSD_BITMAP:
+        ff_osd_stage.bitmap_height = min_t(uint8_t, a[0], BITMAP_HEIGHT);
+        break;
+    case OSD_BLIT:
+        ff_osd_x = ff_osd_y = 0;
+        ff_osd_run = a[2] * a[3];
+        break;
+    case OSD_INFO:
+        /* Register pointer was set in IRQ context, by rx_done(). */
+        break;
+    }
+    ff_osd_cmd = 0;
+}
+
+/* Start of an FF OSD transaction: The previous one is complete. */
+static void ff_osd_start(void)
+{
+    if (ff_osd_staged)
+        ff_osd_commit();
+    ff_osd_run = ff_osd_cmd = 0;
+}
+
+/* Process a span of FF OSD transaction data. */
+static void ff_osd_process(const uint8_t *p, unsigned int n)
+{
+    uint8_t x;
+
+    ff_osd_staged = TRUE;
+    while (n--) {
+        x = *p++;
+        if (ff_osd_run != 0) {
+            /* Character (or Pixel) Data. */
+            switch (ff_osd_sink) {
+            case OSD_MARQUEE:
+                if (ff_osd_x < MARQUEE_MAX)
+                    ff_osd_mq->text[ff_osd_x++] = x;
+                break;
+            case OSD_BLIT:
+                ff_osd_blit(x);
+                break;
+            case OSD_DISCARD:
+                break;
+            default:
+                ff_osd_putc(x);
+                break;
             }
+            ff_osd_run--;
+        } else if (ff_osd_cmd != 0) {
+            /* Command Arguments. */
+            ff_osd_args[ff_osd_argc++] = x;
+            if (ff_osd_argc == ff_osd_nr_args[ff_osd_cmd])
+                ff_osd_exec();
         } else {
-            /* Command. */
+            /* Command. An FF OSD host is present (an address probe alone 
+             * sends no command). */
+            i2c_osd_protocol = TRUE;
             if ((x & 0xc0) == OSD_COLUMNS) {
                 /* 0-40 */
-                i2c_display.cols = min_t(uint16_t, 40, x & 0x3f);
+                ff_osd_stage.cols = min_t(uint16_t, 40, x & 0x3f);
             } else {
                 switch (x & 0xf0) {
                 case OSD_BUTTONS:
                     i2c_buttons_rx = x & 0x0f;
                     break;
                 case OSD_ROWS:
-                    /* 0-3 */
-                    i2c_display.rows = x & 0x03;
+                    /* 0-4 */
+                    ff_osd_stage.rows = min_t(uint16_t, 4, x & 0x0f);
                     break;
                 case OSD_HEIGHTS:
-                    i2c_display.heights = x & 0x0f;
+                    ff_osd_stage.heights = x & 0x0f;
                     break;
                 case OSD_BACKLIGHT:
                     switch (x & 0x0f) {
                     case 0:
-                        i2c_display.on = FALSE;
+                        ff_osd_stage.on = FALSE;
                         break;
                     case 1:
-                        i2c_display.on = TRUE;
+                        ff_osd_stage.on = TRUE;
                         break;
                     case 2:
-                        ff_osd_x = 0;
-                        ff_osd_y = 1;
+                        ff_osd_x = ff_osd_y = 0;
+                        ff_osd_run = ff_osd_stage.rows * ff_osd_stage.cols;
+                        ff_osd_sink = OSD_DATA;
+                        break;
+                    case 3:
+                    case 4:
+                    case 5:
+                    case 6:
+                    case 7:
+                    case 8:
+                        ff_osd_cmd = x;
+                        ff_osd_argc = 0;
                         break;
                     }
                 }
             }
         }
     }
-
-    d_cons = d_c;
-    t_cons = t_c;
 }
 
 static void lcd_process_cmd(uint8_t cmd)
 {
-    uint8_t x = 0x80;
-    int c = 0;
+    int c;
 
     if (!cmd)
         return;
 
-    while (!(cmd & x)) {
-        x >>= 1;
-        c++;
-    }
+    /* Command class is the position of the most significant set bit. */
+    c = __builtin_clz(cmd) - 24;
 
     switch (c) {
     case 0: /* Set DDR Address */
         lcd_ddraddr = cmd & 127;
+        lcd_cgram = FALSE;
         break;
     case 1: /* Set CGR Address */
+        lcd_cgaddr = cmd & 63;
+        lcd_cgram = TRUE;
         break;
     case 2: /* Function Set */
         break;
@@ -212,10 +634,13 @@ static void lcd_process_cmd(uint8_t cmd)
         break;
     case 6: /* Return Home */
         lcd_ddraddr = 0;
+        lcd_cgram = FALSE;
         break;
     case 7: /* Clear Display */
         memset(i2c_display.text, ' ', sizeof(i2c_display.text));
+        i2c_display.dirty = 0xff;
         lcd_ddraddr = 0;
+        lcd_cgram = FALSE;
         break;
     }
 }
@@ -223,6 +648,13 @@ static void lcd_process_cmd(uint8_t cmd)
 static void lcd_process_dat(uint8_t dat)
 {
     int x, y;
+    if (lcd_cgram) {
+        /* Custom glyph row: Any row showing the glyph must be redrawn. */
+        font_write_cgram(lcd_cgaddr, dat);
+        lcd_cgaddr = (lcd_cgaddr + 1) & 63;
+        i2c_display.dirty = 0xff;
+        return;
+    }
     if (lcd_ddraddr >= 0x68)
         lcd_ddraddr = 0x00; /* jump to line 2 */
     if ((lcd_ddraddr >= 0x28) && (lcd_ddraddr < 0x40))
@@ -234,53 +666,398 @@ static void lcd_process_dat(uint8_t dat)
         y += 2;
     }
     i2c_display.text[y][x] = dat;
+    i2c_display.dirty |= 1u << y;
     lcd_ddraddr++;
     if (x >= i2c_display.cols)
         i2c_display.cols = min_t(unsigned int, x+1, config.max_cols);
 }
 
-static void lcd_process(void)
+/* PCF8574 writes which latch a nibble, indexed by EN/RW of the previous and 
+ * current write: Like a real HD44780, a falling edge of EN with RW low. */
+#define LCD_ENRW(x) (((x) & (_EN|_RW)) >> 1)
+static const uint8_t lcd_latch[16] = {
+    [(LCD_ENRW(_EN) << 2) | LCD_ENRW(0)] = 1,
+    [(LCD_ENRW(_EN) << 2) | LCD_ENRW(_RW)] = 1
+};
+
+/* Process a span of PCF8574 writes. Hosts write each nibble with EN high 
+ * then EN low (sometimes with EN low before, too): Only the edge is of 
+ * interest. Writes are decoded without branches, a chunk at a time, into 
+ * bytes tagged with RS, which are then executed. */
+static void lcd_process(const uint8_t *p, unsigned int n)
 {
-    uint16_t d_c, d_p = d_prod;
     static uint16_t dat = 1;
     static bool_t rs;
+    static uint8_t prev; /* last byte written to the PCF8574 */
+    /* Two nibbles per byte, and at least two writes per nibble. */
+    uint16_t out[17];
+    unsigned int i, k, m, e, r;
+    uint8_t x, y = prev;
 
-    /* Process the command sequence. */
-    for (d_c = d_cons; d_c != d_p; d_c++) {
-        uint8_t x = d_ring[MASK(d_ring, d_c)];
-        if ((x & (_EN|_RW)) != _EN)
-            continue;
-        i2c_display.on = !!(x & _BL);
-        if (rs != !!(x & _RS)) {
-            rs ^= 1;
-            dat = 1;
+    while (n != 0) {
+        m = min_t(unsigned int, n, 4*(ARRAY_SIZE(out)-1));
+        for (i = k = 0; i < m; i++) {
+            x = p[i];
+            e = lcd_latch[(LCD_ENRW(y) << 2) | LCD_ENRW(x)];
+            /* A latched nibble with a change of RS starts a new byte. */
+            r = e & (rs ^ !!(y & _RS));
+            rs ^= r;
+            dat ^= (dat ^ 1) & -r;
+            /* Latch the nibble in @y. */
+            dat ^= (dat ^ ((dat << 4) | (y >> 4))) & -e;
+            /* A whole byte is emitted, and the next one begun. */
+            out[k] = dat | (rs << 9);
+            e = dat >> 8;
+            k += e;
+            dat ^= (dat ^ 1) & -e;
+            y = x;
+        }
+        for (i = 0; i < k; i++) {
+            if (out[i] & 0x200)
+                lcd_process_dat(out[i]);
+            else
+                lcd_process_cmd(out[i]);
+        }
+        p += m;
+        n -= m;
+    }
+
+    /* Backlight follows the most recent byte. */
+    i2c_display.on = !!(y & _BL);
+    prev = y;
+
+    /* Codes 0x00-0x0f are this host's CGRAM glyphs. */
+    if (!i2c_display.user_glyphs) {
+        i2c_display.user_glyphs = TRUE;
+        i2c_display.dirty = 0xff;
+    }
+}
+
+/* Transpose an 8x8 pixel block: Bit 7-j of in[i] becomes bit 7-i of out[j].
+ * (Hacker's Delight, transpose8rS32.) */
+static void transpose8(const uint8_t *in, uint8_t *out)
+{
+    uint32_t x, y, t;
+
+    x = (in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
+    y = (in[4] << 24) | (in[5] << 16) | (in[6] << 8) | in[7];
+
+    t = (x ^ (x >> 7)) & 0x00aa00aa;  x = x ^ t ^ (t << 7);
+    t = (y ^ (y >> 7)) & 0x00aa00aa;  y = y ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000cccc; x = x ^ t ^ (t << 14);
+    t = (y ^ (y >> 14)) & 0x0000cccc; y = y ^ t ^ (t << 14);
+    t = (x & 0xf0f0f0f0) | ((y >> 4) & 0x0f0f0f0f);
+    y = ((x << 4) & 0xf0f0f0f0) | (y & 0x0f0f0f0f);
+    x = t;
+
+    out[0] = x >> 24; out[1] = x >> 16; out[2] = x >> 8; out[3] = x;
+    out[4] = y >> 24; out[5] = y >> 16; out[6] = y >> 8; out[7] = y;
+}
+
+/* Mark the whole of GDDRAM dirty, eg. after a change of orientation. */
+static void oled_redraw(void)
+{
+    memset(oled_dirty, 0xff, sizeof(oled_dirty));
+}
+
+/* Copy dirty GDDRAM blocks into i2c_bitmap. Orientation follows the usual 
+ * module setup (segment remap, COM scan decrement) as upright; the other 
+ * settings mirror the image. */
+static void oled_flush(void)
+{
+    unsigned int p, b, i, r, x, y;
+    uint16_t dirty;
+    uint8_t in[8], out[8], inv = oled.invert ? 0xff : 0x00;
+    const uint8_t *s;
+
+    for (p = 0; p < ARRAY_SIZE(oled_ram); p++) {
+        dirty = oled_dirty[p];
+        oled_dirty[p] = 0;
+        for (b = 0; dirty != 0; b++, dirty >>= 1) {
+            if (!(dirty & 1))
+                continue;
+            /* Column bytes of this block, leftmost first. */
+            s = &oled_ram[p][b*8];
+            for (i = 0; i < 8; i++)
+                in[i] = oled.seg_remap ? s[i] : s[7-i];
+            x = oled.seg_remap ? b : 15-b;
+            /* Row r of the block is bit r of each column byte. */
+            transpose8(in, out);
+            for (r = 0; r < 8; r++) {
+                y = (p*8 + r - oled.start_line) & 63;
+                if (y >= oled.height)
+                    continue;
+                if (!oled.com_dec)
+                    y = oled.height - 1 - y;
+                bitmap_write(i2c_bitmap, x, y, out[7-r] ^ inv);
+            }
+        }
+    }
+}
+
+/* Number of argument bytes following an SSD1306 command. */
+static uint8_t oled_nr_args(uint8_t cmd)
+{
+    switch (cmd) {
+    case 0x20: case 0x81: case 0x8d: case 0xa8:
+    case 0xd3: case 0xd5: case 0xd9: case 0xda: case 0xdb:
+        return 1;
+    case 0x21: case 0x22: case 0xa3:
+        return 2;
+    case 0x29: case 0x2a:
+        return 5;
+    case 0x26: case 0x27:
+        return 6;
+    }
+    return 0;
+}
+
+/* Execute an SSD1306 command with all its argument bytes received. 
+ * Scrolling, contrast and hardware configuration are ignored. */
+static void oled_exec(void)
+{
+    uint8_t cmd = oled.cmd, *a = oled.args;
+
+    oled.nr_args = 0;
+
+    if (cmd < 0x10) {
+        /* Set Lower Column Start Address (Page Addressing Mode) */
+        oled.col = (oled.col & 0x70) | (cmd & 0x0f);
+    } else if (cmd < 0x20) {
+        /* Set Higher Column Start Address (Page Addressing Mode) */
+        oled.col = (oled.col & 0x0f) | ((cmd & 0x07) << 4);
+    } else if ((cmd & 0xc0) == 0x40) {
+        /* Set Display Start Line */
+        oled.start_line = cmd & 63;
+        oled_redraw();
+    } else if ((cmd & 0xf8) == 0xb0) {
+        /* Set Page Start Address (Page Addressing Mode) */
+        oled.page = cmd & 7;
+    }
+
+    switch (cmd) {
+    case 0x20: /* Set Memory Addressing Mode */
+        oled.mode = a[0] & 3;
+        break;
+    case 0x21: /* Set Column Address */
+        oled.col = oled.col_start = a[0] & 127;
+        oled.col_end = a[1] & 127;
+        break;
+    case 0x22: /* Set Page Address */
+        oled.page = oled.page_start = a[0] & 7;
+        oled.page_end = a[1] & 7;
+        break;
+    case 0xa0: case 0xa1: /* Set Segment Re-map */
+        oled.seg_remap = cmd & 1;
+        oled_redraw();
+        break;
+    case 0xa6: case 0xa7: /* Set Normal/Inverse Display */
+        oled.invert = cmd & 1;
+        oled_redraw();
+        break;
+    case 0xa8: /* Set Multiplex Ratio */
+        oled.height = max_t(uint8_t, (a[0] & 63) + 1, 16);
+        i2c_display.bitmap_height = oled.height;
+        oled_redraw();
+        break;
+    case 0xae: case 0xaf: /* Set Display Off/On */
+        i2c_display.on = cmd & 1;
+        break;
+    case 0xc0: case 0xc8: /* Set COM Output Scan Direction */
+        oled.com_dec = !!(cmd & 8);
+        oled_redraw();
+        break;
+    }
+}
+
+static void oled_process_cmd(uint8_t x)
+{
+    if (oled.argc < oled.nr_args) {
+        oled.args[oled.argc++] = x;
+        if (oled.argc == oled.nr_args)
+            oled_exec();
+        return;
+    }
+
+    oled.cmd = x;
+    oled.argc = 0;
+    oled.nr_args = oled_nr_args(x);
+    if (!oled.nr_args)
+        oled_exec();
+}
+
+static void oled_process_dat(uint8_t x)
+{
+    oled_ram[oled.page][oled.col] = x;
+    oled_dirty[oled.page] |= 1u << (oled.col / 8);
+
+    switch (oled.mode) {
+    case 0: /* Horizontal */
+        if (oled.col++ >= oled.col_end) {
+            oled.col = oled.col_start;
+            if (oled.page++ >= oled.page_end)
+                oled.page = oled.page_start;
         }
-        dat <<= 4;
-        dat |= x >> 4;
-        if (dat & 0x100) {
-            if (rs)
-                lcd_process_dat(dat);
+        break;
+    case 1: /* Vertical */
+        if (oled.page++ >= oled.page_end) {
+            oled.page = oled.page_start;
+            if (oled.col++ >= oled.col_end)
+                oled.col = oled.col_start;
+        }
+        break;
+    default: /* Page */
+        oled.col = (oled.col + 1) & 127;
+        break;
+    }
+}
+
+/* Process a span of SSD1306 transaction data. Each transaction starts with 
+ * a control byte. */
+static void oled_process(const uint8_t *p, unsigned int n)
+{
+    uint8_t x;
+
+    while (n--) {
+        x = *p++;
+        if (oled.ctl) {
+            /* Control byte: Co, D/C#, 000000. */
+            oled.single = !!(x & 0x80);
+            oled.data = !!(x & 0x40);
+            oled.ctl = FALSE;
+        } else {
+            if (oled.data)
+                oled_process_dat(x);
             else
-                lcd_process_cmd(dat);
-            dat = 1;
+                oled_process_cmd(x);
+            oled.ctl = oled.single;
         }
     }
+}
+
+static void oled_init(void)
+{
+    oled.height = 64;
+    oled.col_end = 127;
+    oled.page_end = 7;
+    oled.mode = 2;
+    i2c_display.cols = 16;
+    i2c_display.bitmap_height = oled.height;
+}
 
-    d_cons = d_c;
+/* Start of a transaction: Route its data by the address it was sent to. */
+static void rx_start(uint16_t t)
+{
+    if (!(t & T_OAR2)) {
+        rx_proto = RX_OSD;
+        ff_osd_start();
+    } else {
+        rx_proto = RX_DISPLAY;
+        oled.ctl = TRUE;
+    }
 }
 
 void i2c_process(void)
 {
-    return i2c_osd_protocol ? ff_osd_process() : lcd_process();
+    uint16_t d_c, d_p, t_c, t_p, t_d, t_pos;
+    unsigned int i, n, laps;
+
+    t_d = t_done;
+    barrier(); /* Get completions /then/ data ring producer */
+    d_c = d_ring.cons;
+    laps = d_prod_update();
+    d_p = d_ring.prod;
+    barrier(); /* Get data ring producer /then/ transaction ring producer */
+    t_c = t_ring.cons;
+    t_p = t_ring.prod;
+
+    /* Every transaction is processed (they may be partial updates) unless 
+     * we fall behind. If the data ring is half full, or transaction starts 
+     * have been overwritten, skip to the newest complete transaction. That 
+     * bounds the work done here, and keeps us well clear of being lapped by 
+     * the DMA. If no transaction is complete, drop everything received and 
+     * resync at the next transaction start. Either way, the transaction in 
+     * progress is torn: Its staged updates are dropped. If the DMA has lapped
+     * us anyway, nothing in the ring can be trusted: Drop everything. */
+    if (laps || ((uint16_t)(d_p - d_c) >= d_ring.size/2)
+        || ((uint16_t)(t_p - t_c) > t_ring.size)) {
+        uint16_t _d_c = d_c, _t_c = t_c;
+        if (!laps && ((int16_t)(t_d - t_c) > 0)
+            && ((uint16_t)(t_p - t_d) < t_ring.size)) {
+            t_c = t_d - 1;
+            d_c += ring_idx(&d_ring,
+                            (t_buf[ring_idx(&t_ring, t_c)] & ~T_OAR2) - d_c);
+        } else {
+            t_c = t_p;
+            d_c = d_p;
+        }
+        rx_proto = RX_NONE;
+        ff_osd_drop();
+        i2c_dropped_transactions += (uint16_t)(t_c - _t_c);
+        i2c_dropped_bytes += (uint16_t)(d_c - _d_c) + laps * d_ring.size;
+#ifndef NDEBUG
+        printk("I2C: Overload: Dropped %u transactions, %u bytes%s\n",
+               (uint16_t)(t_c - _t_c), (uint16_t)(d_c - _d_c),
+               laps ? " (DMA lapped)" : "");
+#endif
+    }
+
+    /* Process received data a span at a time. A span is contiguous in the 
+     * ring and lies within a single transaction. */
+    while (d_c != d_p) {
+        i = ring_idx(&d_ring, d_c);
+        /* Start(s) of transaction here? Empty transactions share their 
+         * start position with the next. */
+        while ((t_c != t_p)
+               && (i == (t_buf[ring_idx(&t_ring, t_c)] & ~T_OAR2)))
+            rx_start(t_buf[ring_idx(&t_ring, t_c++)]);
+        n = min_t(unsigned int, (uint16_t)(d_p - d_c), d_ring.size - i);
+        if (t_c != t_p) {
+            t_pos = t_buf[ring_idx(&t_ring, t_c)] & ~T_OAR2;
+            n = min_t(unsigned int, n, ring_idx(&d_ring, t_pos - i));
+        }
+        switch (rx_proto) {
+        case RX_OSD:
+            ff_osd_process(&d_buf[i], n);
+            break;
+        case RX_DISPLAY:
+            if (i2c_oled)
+                oled_process(&d_buf[i], n);
+            else
+                lcd_process(&d_buf[i], n);
+            break;
+        }
+        d_c += n;
+    }
+
+    /* All received transactions are complete? Then commit. */
+    if (ff_osd_staged && (t_c == t_p) && (t_d == t_p))
+        ff_osd_commit();
+
+    if (i2c_oled)
+        oled_flush();
+
+    i2c_osd_info.dropped_transactions = i2c_dropped_transactions;
+    i2c_osd_info.dropped_bytes = i2c_dropped_bytes;
+    i2c_osd_info.peak_bytes = d_ring.hwm;
+
+    ring_pop_commit(&d_ring, (uint16_t)(d_c - d_ring.cons));
+    ring_pop_commit(&t_ring, (uint16_t)(t_c - t_ring.cons));
+
+    regs_publish();
 }
 
 void i2c_init(void)
 {
     char *p;
 
-    i2c_osd_protocol = gpio_pins_connected(gpioa, 0, gpioa, 1);
+    i2c_oled = (config.host_display == HOST_OLED);
 
-    i2c_osd_info.protocol_ver = 0;
+    i2c_osd_info.protocol_ver = OSD_PROTOCOL_VER;
+    ff_osd_stage.bitmap = ff_osd_committed.bitmap = i2c_display.bitmap
+        = i2c_bitmap;
+    if (i2c_oled)
+        oled_init();
     i2c_osd_info.fw_major = strtol(fw_ver, &p, 10);
     i2c_osd_info.fw_minor = strtol(p+1, NULL, 10);
 
@@ -299,13 +1076,33 @@ void i2c_init(void)
     IRQx_clear_pending(I2C_ERROR_IRQ);
     IRQx_enable(I2C_ERROR_IRQ);
 
-    /* Initialise I2C. */
+    /* RX DMA: Circular, from DR into the data ring. Half-transfer and 
+     * transfer-complete IRQs count its laps. */
+    IRQx_set_prio(I2C_RX_DMA_IRQ, I2C_IRQ_PRI);
+    IRQx_clear_pending(I2C_RX_DMA_IRQ);
+    IRQx_enable(I2C_RX_DMA_IRQ);
+    i2c_rx_dma.cpar = (uint32_t)(unsigned long)&i2c->dr;
+    i2c_rx_dma.cmar = (uint32_t)(unsigned long)d_buf;
+    i2c_rx_dma.cndtr = ARRAY_SIZE(d_buf);
+    i2c_rx_dma.ccr = (DMA_CCR_PL_HIGH |
+                      DMA_CCR_MSIZE_8BIT |
+                      DMA_CCR_PSIZE_32BIT |
+                      DMA_CCR_MINC |
+                      DMA_CCR_CIRC |
+                      DMA_CCR_DIR_P2M |
+                      DMA_CCR_HTIE |
+                      DMA_CCR_TCIE |
+                      DMA_CCR_EN);
+
+    /* Initialise I2C. DMAEN and ITBUFEN are set per transaction, on ADDR. 
+     * We answer as FF OSD on OAR1, and as the emulated LCD or OLED on OAR2. 
+     * Transactions are routed by which address matched (SR2_DUALF). */
     i2c->cr1 = 0;
-    i2c->oar1 = (i2c_osd_protocol ? 0x10 : 0x27) << 1;
+    i2c->oar1 = 0x10 << 1;
+    i2c->oar2 = ((i2c_oled ? 0x3c : 0x27) << 1) | I2C_OAR2_ENDUAL;
     i2c->cr2 = (I2C_CR2_FREQ(36) |
                 I2C_CR2_ITERREN |
-                I2C_CR2_ITEVTEN |
-                I2C_CR2_ITBUFEN);
+                I2C_CR2_ITEVTEN);
     i2c->cr1 = I2C_CR1_ACK | I2C_CR1_PE;
 }
 
@@ -13,7 +13,8 @@
  * PIN ASSIGNMENTS:
  * 
  * FF OSD I2C Special Protocol (use with FlashFloppy v3.4a or later):
- *  A0-A1: Jumper/Strap
+ *  Always served at I2C address 0x10, alongside the emulated LCD (0x27) or 
+ *  OLED (0x3c) selected in config. No jumper/strap is needed.
  * 
  * Reset to Factory Defaults:
  *  A1-A2: Jumper/Strap
@@ -22,8 +23,8 @@
  *  A0: CLK
  *  A1: DAT
  *  A2: SEL
- * [NB. Rotary Encoder is unavailable if A0-A1 is jumpered, but FF OSD
- *      can be configured via FlashFloppy]
+ * [NB. Rotary Encoder is ignored once an FF OSD host has sent a command.
+ *      FF OSD is then configured via FlashFloppy]
  * 
  * Serial Console:
  *  A9: TX
@@ -50,20 +51,13 @@
  *  B10: U2
  */
 
-/* CSYNC/HSYNC (A8): EXTI IRQ trigger and TIM1 Ch.1 trigger. */
-#define gpio_csync gpioa
-#define pin_csync  8
-#define irq_csync  23
+/* CSYNC/HSYNC (A8) and VSYNC (B14): See sync.h. */
 void IRQ_23(void) __attribute__((alias("IRQ_csync"))); /* EXTI9_5 */
-
-/* VSYNC (B14): EXTI IRQ trigger. */
-#define gpio_vsync gpiob
-#define pin_vsync  14
-#define irq_vsync  40
 void IRQ_40(void) __attribute__((alias("IRQ_vsync"))); /* EXTI15_10 */
 
 /* TIM1 Ch.3: Triggered at horizontal end of OSD box. 
- * TIM1 counter is started by TIM2 UEV (ie. when SPI DMA begins). */
+ * TIM1 counter is started by TIM2 UEV (ie. when SPI DMA begins).
+ * In DMA-chain mode TIM1 instead runs free, reset at end of every sync. */
 #define tim1_ch3_dma (dma1->ch6)
 #define tim1_ch3_dma_ch 6
 #define tim1_ch3_dma_tc_irq 16
@@ -73,6 +67,15 @@ void IRQ_16(void) __attribute__((alias("IRQ_osd_end")));
 #define tim1_cc_irq 27
 void IRQ_27(void) __attribute__((alias("IRQ_osd_pre_end")));
 
+/* TIM1 UEV: Hardware line counter has reached the line before the OSD box.
+ * Between start of frame and the OSD box, TIM1 is clocked by CSYNC/HSYNC. */
+#define tim1_up_irq 25
+void IRQ_25(void) __attribute__((alias("IRQ_line_count")));
+
+/* Software IRQ: Renders OSD lines just ahead of scanout (streaming mode). */
+#define irq_render 19
+void IRQ_19(void) __attribute__((alias("IRQ_render"))); /* USB_HP_CAN_TX */
+
 /* TIM2: Ch.1 Output Compare triggers IRQ. Overflow triggers SPI DMA. 
  * Counter starts on TIM1 UEV (itself triggered by TIM1 Ch.1 input pin). */
 #define tim2_irq 28
@@ -81,12 +84,13 @@ void IRQ_28(void) __attribute__((alias("IRQ_osd_pre_start")));
 #define tim2_up_dma_ch 2
 #define tim2_up_dma_tc_irq 12
 
-/* TIM4: Overflow triggers DMA to enable Display Output.
+/* TIM4: Ch.1 Output Compare (at ARR, ie. overflow) triggers DMA to enable
+ * Display Output. DMA1 Ch.7 (TIM4_UP) is left free for I2C1 RX.
  * Counter starts on TIM1 UEV (itself triggered by TIM1 Ch.1 input pin). */
 #define tim4_irq 30
-#define tim4_up_dma (dma1->ch7)
-#define tim4_up_dma_ch 7
-#define tim4_up_dma_tc_irq 17
+#define tim4_ch1_dma (dma1->ch1)
+#define tim4_ch1_dma_ch 1
+#define tim4_ch1_dma_tc_irq 11
 
 /* Display Output (A7): Pixels are generated by SPI1. */
 #define gpio_display_spi1 gpioa
@@ -104,6 +108,13 @@ void IRQ_28(void) __attribute__((alias("IRQ_osd_pre_start")));
 #define dma_display_ch_spi2 5
 #define dma_display_irq_spi2 15
 
+/* DMA chain: Per-line SPI DMA address is loaded from osd_frame.cmar[] at end of 
+ * sync, using the DMA channel belonging to the unused SPI.
+ * SPI1 output: Triggered by TIM1 UEV (DMA1 Ch.5).
+ * SPI2 output: Triggered by TIM1 Ch.2 input capture on TI1 (DMA1 Ch.3). */
+#define osd_cmar_dma_spi1 (dma1->ch5)
+#define osd_cmar_dma_spi2 (dma1->ch3)
+
 /* Display Enable (A15): If using an external tristate buffer. */
 #define gpio_dispen gpioa
 #define pin_dispen  15
@@ -114,19 +125,19 @@ void IRQ_28(void) __attribute__((alias("IRQ_osd_pre_start")));
 
 /* List of interrupts used by the display-sync and -output system. */
 const static uint8_t irqs[] = {
-    tim1_cc_irq, tim2_irq, tim1_ch3_dma_tc_irq, irq_csync, irq_vsync
+    tim1_cc_irq, tim2_irq, tim1_ch3_dma_tc_irq, irq_csync, irq_vsync,
+    tim1_up_irq
 };
 
 int EXC_reset(void) __attribute__((alias("main")));
 
-#include "font.h"
-
 void setup_spi(uint16_t video_mode);
-static void slave_arr_update(void);
 static uint16_t startup_display_spi;
 static uint16_t startup_dispctl_mode;
-uint16_t running_display_timing;
+uint16_t running_display_timing; /* index into video_timings[] */
+const char *running_timing_name;
 uint16_t running_polarity, detected_polarity;
+static bool_t osd_dma_chain = TRUE;
 
 /* Guard the stacks with known values. */
 static void canary_init(void)
@@ -198,6 +209,11 @@ static void button_amikeys(void)
         config.display_timing = DISP_AUTO;
         config.polarity = SYNC_AUTO;
     }
+    /* OSD scanout: DMA chain vs. per-line IRQs. */
+    if (amiga_key_pressed(AMI_KPSTAR)) {
+        osd_dma_chain ^= 1;
+        printk("OSD scanout: %s\n", osd_dma_chain ? "DMA chain" : "IRQ");
+    }
 #endif
 }
 
@@ -248,186 +264,379 @@ static void button_timer_fn(void *unused)
 }
 
 #define MAX_DISPLAY_HEIGHT 52
-static uint16_t display_dat[MAX_DISPLAY_HEIGHT][40/2+1];
+/* Tallest OSD box (before 2Y doubling), from a frame buffer or a bitmap. */
+#define MAX_BOX_HEIGHT ((BITMAP_HEIGHT > MAX_DISPLAY_HEIGHT)    \
+                        ? BITMAP_HEIGHT : MAX_DISPLAY_HEIGHT)
 static struct display *cur_display = &i2c_display;
-static uint16_t display_height;
-
 
-static void slave_arr_update(void)
+/* OSD frame buffers: The main loop renders into the back buffer and 
+ * publishes it (osd_pending). IRQ_csync swaps it to the front at vertical 
+ * start of the OSD box. The front buffer is never written. */
+static struct osd_frame {
+    /* What is rendered here. */
+    struct display *display;
+    int rows, cols;
+    uint8_t heights;
+    uint8_t dirty; /* text rows modified since rendered here */
+    bool_t on, dbl_y, stream;
+    /* Interlaced: Each field scans out alternate text lines. The odd 
+     * field's cmar[] follow the even field's. */
+    bool_t fields;
+    /* Text lines (before 2Y doubling), and lines in the OSD box (per 
+     * field). */
+    uint16_t text_height, height;
+    /* Width of the OSD box in TIM1 ticks, from start of SPI DMA. */
+    uint16_t box_ticks;
+    /* Streaming mode: Snapshot of the display, rendered during scanout. */
+    struct display snap;
+    /* DMA chain: SPI DMA address for each line of the OSD box. */
+    uint32_t cmar[2*MAX_BOX_HEIGHT];
+    /* Pixel lines scanned out: dat[], or the display's bitmap. */
+    const uint16_t (*lines)[LINE_WORDS];
+    uint16_t dat[MAX_DISPLAY_HEIGHT][LINE_WORDS];
+} osd_frames[2] = {
+    { .lines = osd_frames[0].dat }, { .lines = osd_frames[1].dat }
+}, *osd_front = &osd_frames[0];
+#define osd_back (&osd_frames[osd_front == &osd_frames[0]])
+static volatile bool_t osd_pending;
+
+/* Set by display_off() to blank the OSD until the main loop next sees end 
+ * of frame. */
+static volatile bool_t display_blank;
+
+/* Streaming mode: If the OSD box is taller than a frame buffer, lines are 
+ * rendered by IRQ_render into a small ring, just ahead of scanout. The box
+ * is then generated with per-line IRQs (not the DMA chain). The ring is 
+ * primed for the next frame at end of frame. */
+#define LINE_RING 4
+static uint16_t line_ring[LINE_RING][LINE_WORDS];
+static struct osd_frame *stream_frame;
+static uint16_t stream_y, stream_render_y;
+
+static bool_t osd_chain_active;
+
+
+void slave_arr_update(void)
 {
-    unsigned int hstart;
-    switch (running_display_timing) {
-        case DISP_VGA:
-            vstart = config.v_off*2;
-            if (startup_display_spi == DISP_SPI1) {
-                hstart = config.h_off * 7;
-
-                /* Enable output pin first (TIM4) and then start SPI transfers (TIM2).
-                 * timers run at 72 MHz, pixel clock is 36 MHz, 2 count per pixel
-                 * (13-1)/2 = 6 pixel
-                 */
-                tim4->arr = hstart-12;
-                tim2->arr = hstart-1;
-            } else {
-                hstart = config.h_off * 7;
-
-                /* Enable output pin first (TIM4) and then start SPI transfers (TIM2).
-                 * timers run at 72 MHz, pixel clock is 18 MHz, 4 count per pixel
-                 * (25-1)/4 = 6 pixel
-                 */
-                tim4->arr = hstart-24;
-                tim2->arr = hstart-1;
-            }
-        break;
+    const struct video_timing *t = &video_timings[running_display_timing];
+    unsigned int hstart = config.h_off * t->h_scale;
 
-        case DISP_15KHZ:
-        default:
-            vstart = config.v_off;
-            hstart = config.h_off * 20;
+    vstart = config.v_off * t->v_scale;
 
-            /* Enable output pin first (TIM4) and then start SPI transfers (TIM2).
-             * timers run at 72 MHz, pixel clock is 9 MHz, 8 count per pixel
-             * (49-1)/8 = 6 pixel */
-            tim4->arr = hstart-49;
-            tim2->arr = hstart-1;
-        break;
-    }
+    /* Enable output pin first (TIM4) and then start SPI transfers (TIM2). 
+     * Timers run at 72MHz: The lead-in is about 6 pixels. */
+    tim4->arr = hstart - t->spi[startup_display_spi].lead;
+    tim2->arr = hstart - 1;
+
+    /* TIM4 Ch.1 fires DMA as the counter reaches ARR. */
+    tim4->ccr1 = tim4->arr;
 
     /* Trigger TIM2 IRQ 1us before OSD box. */
     tim2->ccr1 = hstart - sysclk_us(1);
 }
 
-static void set_polarity(void)
+/* CPU cycles spent in the display-sync IRQ handlers: Accumulated over each 
+ * frame, and snapshotted into sync_cycles_frame at end of frame. */
+static uint32_t sync_cycles, sync_cycles_frame;
+#define sync_irq_enter() uint32_t __sync_t = dwt->cyccnt
+#define sync_irq_exit() (sync_cycles += dwt->cyccnt - __sync_t)
+
+static void end_of_frame(void)
 {
-    if (running_polarity) {
-        /* Active High: Rising edge = sync start */
-        exti->ftsr &= ~(m(pin_csync) | m(pin_vsync));
-        exti->rtsr |= m(pin_csync) | m(pin_vsync); /* Rising edge */
-        tim1->ccer |= TIM_CCER_CC1P; /* Falling edge */
-    } else {
-        /* Active Low: Falling edge = sync start */
-        exti->rtsr &= ~(m(pin_csync) | m(pin_vsync));
-        exti->ftsr |= m(pin_csync) | m(pin_vsync); /* Falling edge */
-        tim1->ccer &= ~TIM_CCER_CC1P; /* Rising edge */
+    struct osd_frame *next = osd_pending ? osd_back : osd_front;
+
+    sync_frame_end();
+    sync_cycles_frame = sync_cycles;
+    sync_cycles = 0;
+
+    /* Prime the line ring if the next frame is streamed. */
+    if (next->stream) {
+        stream_frame = next;
+        stream_y = stream_render_y = 0;
+        IRQx_set_pending(irq_render);
     }
 }
 
-static int hline, frame;
-#define HLINE_EOF -1
-#define HLINE_VBL 0
-#define HLINE_SOF 1
+/* Called at vertical start of OSD box: Swap in a newly-published frame. 
+ * A streamed frame must wait until the line ring is primed for it. */
+static void osd_swap(void)
+{
+    struct osd_frame *back = osd_back;
+    if (!osd_pending || (back->stream && (stream_frame != back)))
+        return;
+    osd_front = back;
+    osd_pending = FALSE;
+}
 
-static void IRQ_vsync(void)
+/* Lines in the OSD box this frame. */
+static uint16_t osd_height(void)
 {
-    exti->pr = m(pin_vsync);
-    tim1->smcr = 0;
-    hline = HLINE_VBL;
+    return display_blank ? 0 : osd_front->height;
 }
 
-#define sync_log_MAX 20
-volatile static int sync_log_ptr;
-volatile static int32_t sync_log[sync_log_MAX];
+/* Lower-priority IRQs are masked in the NVIC around the critical start and 
+ * end of each OSD line: Whichever are enabled at the time, other than the 
+ * sync IRQs (irqs[]). We do not raise BASEPRI here as it would race with 
+ * IRQ_save/IRQ_restore in thread context. 
+ * Build with quiesce_spin=y to spin for 1us instead, as before, to compare 
+ * sync_cycles_frame. */
+static uint32_t sync_irq_mask[2], quiesce_mask[2];
+
+static void quiesce_init(void)
+{
+    int i;
+    for (i = 0; i < ARRAY_SIZE(irqs); i++)
+        sync_irq_mask[irqs[i]>>5] |= 1u << (irqs[i]&31);
+}
+
+static void irq_quiesce(void)
+{
+#ifdef QUIESCE_SPIN
+    delay_us(1);
+#else
+    uint32_t m0 = nvic->iser[0] & ~sync_irq_mask[0];
+    uint32_t m1 = nvic->iser[1] & ~sync_irq_mask[1];
+    nvic->icer[0] = m0;
+    nvic->icer[1] = m1;
+    quiesce_mask[0] |= m0;
+    quiesce_mask[1] |= m1;
+    cpu_sync();
+#endif
+}
 
-#define sync_sum_MAX 1000
-volatile static int sync_sum_ptr;
-volatile static int32_t sync_sum_high;
-volatile static int32_t sync_sum_low;
+static void irq_unquiesce(void)
+{
+    nvic->iser[0] = quiesce_mask[0];
+    nvic->iser[1] = quiesce_mask[1];
+    quiesce_mask[0] = quiesce_mask[1] = 0;
+}
 
-static time_t last_sync_time;
+/* SPI DMA CCR values written by tim2_up_dma: [0] at start of OSD box; 
+ * [1] at end of OSD box (DMA chain only). */
+static uint16_t dma_display_ccr[2] = {
+    (DMA_CCR_PL_V_HIGH |
+     DMA_CCR_MSIZE_16BIT |
+     DMA_CCR_PSIZE_16BIT |
+     DMA_CCR_MINC |
+     DMA_CCR_DIR_M2P |
+     DMA_CCR_EN),
+    0
+};
 
-static void IRQ_csync(void)
+/* Per-line IRQ scanout: TIM2 UEV enables SPI DMA. TIM1 Ch.3 disables 
+ * display output and interrupts us at end of every line. */
+static void osd_irq_dma_setup(void)
 {
-    exti->pr = m(pin_csync);
+    tim2_up_dma.ccr = 0;
+    tim2_up_dma.cndtr = 1;
+    tim2_up_dma.ccr = (DMA_CCR_PL_V_HIGH |
+                       DMA_CCR_MSIZE_16BIT |
+                       DMA_CCR_PSIZE_32BIT |
+                       DMA_CCR_CIRC |
+                       DMA_CCR_DIR_M2P |
+                       DMA_CCR_EN);
 
-    if (hline <= 0) { /* EOF or VBL */
+    tim1_ch3_dma.ccr = 0;
+    tim1_ch3_dma.cndtr = 1;
+    tim1_ch3_dma.ccr = (DMA_CCR_PL_V_HIGH |
+                        DMA_CCR_MSIZE_32BIT |
+                        DMA_CCR_PSIZE_32BIT |
+                        DMA_CCR_CIRC |
+                        DMA_CCR_DIR_M2P |
+                        DMA_CCR_TCIE |
+                        DMA_CCR_EN);
+}
 
-        static time_t p, last_polarity_time;
-        time_t t = time_now();
-        bool_t csync_now = gpio_read_pin(gpio_csync, pin_csync);
+/* DMA chain: The OSD box is generated without per-line IRQs. TIM1 runs 
+ * free, reset at end of every sync (triggering TIM2 and TIM4 as usual).
+ * On each line:
+ *  End of sync: SPI DMA CMAR is loaded from osd_frame.cmar[].
+ *  TIM4 Ch.1:   Display output enabled (tim4_ch1_dma).
+ *  TIM2 UEV:    SPI DMA enabled (tim2_up_dma <- dma_display_ccr[0]).
+ *  TIM1 Ch.1:   SPI DMA disabled (tim2_up_dma <- dma_display_ccr[1]).
+ *  TIM1 Ch.3:   Display output disabled (tim1_ch3_dma).
+ * The SPI DMA transfer count is loaded once per frame and never runs out.
+ * tim1_ch3_dma counts the box lines and raises the only IRQ, at box end.
+ * Called from IRQ_csync at start of sync on the first line of the box. */
+static void osd_chain_start(void)
+{
+    volatile struct dma_chn *spi_dma, *cmar_dma;
+    struct osd_frame *f = osd_front;
+    uint16_t box_end = tim2->arr + 1 + f->box_ticks;
 
-        /* Trigger on both sync edges so we can measure sync pulse width: 
-         * Normal Sync ~= 5us, Porch+Data ~= 59us */
-        exti->ftsr |= m(pin_csync) | m(pin_vsync);
-        exti->rtsr |= m(pin_csync) | m(pin_vsync);
+    if (startup_display_spi == DISP_SPI1) {
+        spi_dma = &dma_display_spi1;
+        cmar_dma = &osd_cmar_dma_spi1;
+    } else {
+        spi_dma = &dma_display_spi2;
+        cmar_dma = &osd_cmar_dma_spi2;
+    }
 
-        /* do some sync polarity calculations */
-        /* ignore negative diff */
-        if ( time_diff(last_polarity_time, t) < 0 )
-            last_polarity_time = t;
+    osd_chain_active = TRUE;
+
+    /* Mask the sync IRQ, and TIM2 no longer interrupts us on each line. */
+    exti->imr &= ~m(pin_csync);
+    tim2->dier = TIM_DIER_UDE;
+
+    spi_dma->ccr = 0;
+    spi_dma->cndtr = 0xffff;
+
+    cmar_dma->ccr = 0;
+    cmar_dma->cpar = (uint32_t)(unsigned long)&spi_dma->cmar;
+    cmar_dma->cmar = (uint32_t)(unsigned long)
+        &f->cmar[(f->fields && odd_field) ? f->height : 0];
+    cmar_dma->cndtr = f->height;
+    cmar_dma->ccr = (DMA_CCR_PL_V_HIGH |
+                     DMA_CCR_MSIZE_32BIT |
+                     DMA_CCR_PSIZE_32BIT |
+                     DMA_CCR_MINC |
+                     DMA_CCR_DIR_M2P |
+                     DMA_CCR_EN);
+
+    tim2_up_dma.ccr = 0;
+    tim2_up_dma.cndtr = 2;
+    tim2_up_dma.ccr = (DMA_CCR_PL_V_HIGH |
+                       DMA_CCR_MSIZE_16BIT |
+                       DMA_CCR_PSIZE_32BIT |
+                       DMA_CCR_MINC |
+                       DMA_CCR_CIRC |
+                       DMA_CCR_DIR_M2P |
+                       DMA_CCR_EN);
 
-        if (csync_now) // its high now, so it was a low pulse
-            sync_sum_low += time_diff(last_polarity_time, t);
-        else
-            sync_sum_high += time_diff(last_polarity_time, t);
-        last_polarity_time = t;
+    tim1_ch3_dma.ccr = 0;
+    tim1_ch3_dma.cndtr = f->height;
+    tim1_ch3_dma.ccr = (DMA_CCR_PL_V_HIGH |
+                        DMA_CCR_MSIZE_32BIT |
+                        DMA_CCR_PSIZE_32BIT |
+                        DMA_CCR_DIR_M2P |
+                        DMA_CCR_TCIE |
+                        DMA_CCR_EN);
 
-        if (sync_sum_ptr++ >= sync_sum_MAX) {
+    /* TIM1 Ch.1 becomes an output compare at end of box (TI1FP1 still 
+     * resets the counter). Ch.2 captures end of sync from TI1. */
+    tim1->dier = 0;
+    tim1->ccer &= ~(TIM_CCER_CC1E | TIM_CCER_CC2E);
+    tim1->ccmr1 = (TIM_CCMR1_CC1S(TIM_CCS_OUTPUT)
+                   | TIM_CCMR1_CC2S(TIM_CCS_INPUT_TI2)); /* IC2 <- TI1 */
+    tim1->ccer |= TIM_CCER_CC2E;
+    tim1->ccr1 = tim1->ccr3 = box_end;
+
+    /* Count from well clear of the compare values: The reset at end of 
+     * this sync pulse begins the first line. */
+    tim1->cnt = 0x10000 - sysclk_us(12);
+    tim1->sr = 0;
+    tim1->dier = (TIM_DIER_CC1DE | TIM_DIER_CC3DE
+                  | ((startup_display_spi == DISP_SPI1)
+                     ? TIM_DIER_UDE : TIM_DIER_CC2DE));
+    tim1->smcr = (TIM_SMCR_MSM
+                  | TIM_SMCR_TS(5) /* Filtered TI1 */
+                  | TIM_SMCR_SMS(4)); /* Reset Mode */
+    tim1->cr1 = TIM_CR1_ARPE | TIM_CR1_CEN;
+}
 
-            /* 39kHz VGA is  low for ~11x longer than high
-             * 15kHz PAL is high for ~13x longer than low */
-            if (sync_sum_low > 8*sync_sum_high)
-                detected_polarity = SYNC_HIGH;
-            if (sync_sum_high > 4*sync_sum_low)
-                detected_polarity = SYNC_LOW;
+/* Return to per-line IRQ configuration and unmask the sync IRQ. */
+static void osd_chain_stop(void)
+{
+    if (!osd_chain_active)
+        return;
 
-            sync_sum_low = sync_sum_high = sync_sum_ptr = 0;
-        }
+    tim1->cr1 = TIM_CR1_ARPE | TIM_CR1_OPM;
+    tim1->smcr = 0;
+    tim1->dier = 0;
+    tim1->ccer &= ~TIM_CCER_CC2E;
+    tim1->ccmr1 = TIM_CCMR1_CC1S(TIM_CCS_INPUT_TI1);
+    tim1->ccer |= TIM_CCER_CC1E;
+    tim1->cnt = 0;
+    tim1->sr = 0;
+    tim1->dier = TIM_DIER_CC3DE | TIM_DIER_CC4IE;
 
-        if (csync_now == running_polarity) {
+    if (startup_display_spi == DISP_SPI1) {
+        dma_display_spi1.ccr = 0;
+        osd_cmar_dma_spi1.ccr = 0;
+    } else {
+        dma_display_spi2.ccr = 0;
+        osd_cmar_dma_spi2.ccr = 0;
+    }
+    osd_irq_dma_setup();
 
-            /* Sync pulse start: remember the current time. */
-            p = t;
+    tim2->sr = 0;
+    tim2->dier = TIM_DIER_UDE | TIM_DIER_CC1IE;
 
-        } else if (time_diff(p, t) > time_us(10)) {
+    exti->pr = m(pin_csync);
+    exti->imr |= m(pin_csync);
 
-            /* Long sync: We are in vblank. */
-            hline = HLINE_VBL;
+    osd_chain_active = FALSE;
+}
 
-        } else if (hline == HLINE_VBL) {
+static void IRQ_line_count(void)
+{
+    sync_irq_enter();
+    sync_line_count();
+    sync_irq_exit();
+}
 
-            /* Short sync: We are outside the vblank period. Start frame (we
-             * were previously in vblank). */
-            hline = HLINE_SOF;
-            slave_arr_update();
-            set_polarity();
+static void IRQ_vsync(void)
+{
+    sync_irq_enter();
+    osd_chain_stop();
+    sync_vsync();
+    sync_irq_exit();
+}
 
-        }
+static void IRQ_csync(void)
+{
+    sync_irq_enter();
 
-    } else if (++hline < vstart) {
+    if (sync_csync()) {
 
-        /* Before vertical start of OSD: Time hsync pulses. */
-        time_t this_sync_time = time_now();
-        sync_log[sync_log_ptr++] =  time_diff(last_sync_time, this_sync_time);
-        last_sync_time = this_sync_time;
-        if (sync_log_ptr >= sync_log_MAX)
-            sync_log_ptr = 0;
+        /* Vertical start of OSD: Swap in a newly-published frame. */
+        if (hline == vstart)
+            osd_swap();
 
-    } else if (hline >= (vstart + display_height)) {
+        if (hline >= (vstart + osd_height())) {
 
-        /* Vertical end of OSD: Disable TIM1 trigger and signal main loop. */
-        tim1->smcr = 0;
-        hline = HLINE_EOF;
-        frame++;
+            /* Vertical end of OSD: Disable TIM1 trigger and signal main 
+             * loop. */
+            tim1->smcr = 0;
+            end_of_frame();
 
-    } else {
+        } else if ((hline == vstart) && osd_dma_chain && !osd_front->stream) {
 
-        /* Within OSD vertical area: Set up for next line. */
+            /* Vertical start of OSD: The whole box is generated by DMA. */
+            osd_chain_start();
 
-        /* Set TIM1 to reset (causing UEV) when triggered by Ch.1 input pin
-         * (Ch.1 input pin is CSYNC/HSYNC, triggering on end-of-sync). */
-        tim1->smcr = (TIM_SMCR_MSM
-                      | TIM_SMCR_TS(5) /* Filtered TI1 */
-                      | TIM_SMCR_SMS(4)); /* Reset Mode */
+        } else {
 
-        if (hline == vstart) {
-            /* Set up for first line of OSD box. */
-            if (startup_display_spi == DISP_SPI1) {
-                dma_display_spi1.cmar = (uint32_t)(unsigned long)display_dat;
-            } else {
-                dma_display_spi2.cmar = (uint32_t)(unsigned long)display_dat;
+            /* Within OSD vertical area: Set up for next line. */
+
+            /* Set TIM1 to reset (causing UEV) when triggered by Ch.1 input
+             * pin (Ch.1 input pin is CSYNC/HSYNC, triggering on 
+             * end-of-sync). */
+            tim1->smcr = (TIM_SMCR_MSM
+                          | TIM_SMCR_TS(5) /* Filtered TI1 */
+                          | TIM_SMCR_SMS(4)); /* Reset Mode */
+
+            if (hline == vstart) {
+                /* Set up for first line of OSD box. */
+                struct osd_frame *f = osd_front;
+                uint32_t cmar = (uint32_t)(unsigned long)
+                    (f->stream ? line_ring[0]
+                     : f->lines[(f->fields && odd_field) ? 1 : 0]);
+                tim1->ccr3 = f->box_ticks;
+                tim1->ccr4 = f->box_ticks - sysclk_us(1);
+                if (startup_display_spi == DISP_SPI1) {
+                    dma_display_spi1.cndtr = f->cols/2 + 1;
+                    dma_display_spi1.cmar = cmar;
+                } else {
+                    dma_display_spi2.cndtr = f->cols/2 + 1;
+                    dma_display_spi2.cmar = cmar;
+                }
             }
         }
+
     }
+
+    sync_irq_exit();
 }
 
 /* Display On/Off: Which register to write, and what values to write there. */
@@ -487,53 +696,86 @@ static void setup_dispctl_mode(void)
     }
 }
 
-static uint16_t dma_display_ccr = (DMA_CCR_PL_V_HIGH |
-                                   DMA_CCR_MSIZE_16BIT |
-                                   DMA_CCR_PSIZE_16BIT |
-                                   DMA_CCR_MINC |
-                                   DMA_CCR_DIR_M2P |
-                                   DMA_CCR_EN);
-
 /* Triggered by TIM2 1us before the start of the OSD box. We use this to 
  * quiesce interrupts during the critical initial OSD DMAs. We also retask
- * TIM1 to cleanly finish the OSD box at end of line. */
+ * TIM1 to cleanly finish the OSD box at end of line. 
+ * Triggered again by TIM2 UEV (SPI DMA started) to end the quiesce. */
 static void IRQ_osd_pre_start(void)
 {
-    /* Set TIM1 to start counting when triggered by TIM2. Output-compare 
-     * will trigger DMA to disable OSD output at end of line. */
-    tim1->smcr = (TIM_SMCR_TS(1) /* Timer 2 */
-                  | TIM_SMCR_SMS(6)); /* Trigger Mode (starts counter) */
+    uint16_t sr = tim2->sr;
+    sync_irq_enter();
 
-    tim2->sr = 0;
-    delay_us(1);
+    tim2->sr = ~sr;
+
+    if (sr & TIM_SR_UIF) {
+        tim2->dier &= ~TIM_DIER_UIE;
+        irq_unquiesce();
+    }
+
+    if (sr & TIM_SR_CC1IF) {
+        /* Set TIM1 to start counting when triggered by TIM2. Output-compare 
+         * will trigger DMA to disable OSD output at end of line. */
+        tim1->smcr = (TIM_SMCR_TS(1) /* Timer 2 */
+                      | TIM_SMCR_SMS(6)); /* Trigger Mode (starts counter) */
+        irq_quiesce();
+#ifndef QUIESCE_SPIN
+        tim2->dier |= TIM_DIER_UIE;
+#endif
+    }
+
+    sync_irq_exit();
 }
 
-/* Triggered by TIM1's Ch.4 Output Compare. */
+/* Triggered by TIM1's Ch.4 Output Compare. Quiesce until IRQ_osd_end. */
 static void IRQ_osd_pre_end(void)
 {
+    sync_irq_enter();
     tim1->sr = 0;
-    delay_us(1);
+    irq_quiesce();
+    sync_irq_exit();
 }
 
 /* Triggered by TIM1's DMA completion at horizontal end of OSD box. */
 static void IRQ_osd_end(void)
 {
+    volatile struct dma_chn *dma = (startup_display_spi == DISP_SPI1)
+        ? &dma_display_spi1 : &dma_display_spi2;
+    struct osd_frame *f = osd_front;
+    sync_irq_enter();
+
     /* Clear interrupt and stop timer. */
     dma1->ifcr = DMA_IFCR_CGIF(tim1_ch3_dma_ch);
     tim1->cr1 &= ~TIM_CR1_CEN;
 
-    /* Point SPI DMA at next line of data. */
-    if (startup_display_spi == DISP_SPI1) {
-        dma_display_spi1.ccr = 0;
-        dma_display_spi1.cndtr = cur_display->cols/2 + 1;
-        if ((config.display_2Y == FALSE) || (hline & 0x1))
-            dma_display_spi1.cmar += sizeof(display_dat[0]);
+    if (osd_chain_active) {
+
+        /* DMA chain: This is the end of the last line of the OSD box. */
+        osd_chain_stop();
+        end_of_frame();
+
     } else {
-        dma_display_spi2.ccr = 0;
-        dma_display_spi2.cndtr = cur_display->cols/2 + 1;
-        if ((config.display_2Y == FALSE) || (hline & 0x1))
-            dma_display_spi2.cmar += sizeof(display_dat[0]);
+
+        irq_unquiesce();
+
+        /* Point SPI DMA at next line of data. */
+        dma->ccr = 0;
+        dma->cndtr = f->cols/2 + 1;
+        if (!f->dbl_y || (hline & 0x1)) {
+            if (f->stream) {
+                /* Next line is already rendered. Render more behind it. */
+                stream_y++;
+                dma->cmar = (uint32_t)(unsigned long)
+                    line_ring[stream_y & (LINE_RING-1)];
+                IRQx_set_pending(irq_render);
+            } else {
+                dma->cmar += f->fields ? 2*sizeof(f->dat[0])
+                    : sizeof(f->dat[0]);
+            }
+        }
+
     }
+
+    sync_irq_exit();
 }
 
 /* Set up a slave timer to be triggered by TIM1. */
@@ -548,44 +790,126 @@ static void setup_slave_timer(TIM tim)
                  | TIM_SMCR_SMS(6)); /* Trigger Mode (starts counter) */
 }
 
-static void render_line(int y, const struct display *display)
+/* Streaming mode: Fill the line ring up to LINE_RING-1 lines beyond the 
+ * line currently being displayed. Runs below SYNC_IRQ_PRI, so it is 
+ * preempted by the line-critical IRQs. */
+static void IRQ_render(void)
 {
-    unsigned int x, row;
-    const uint8_t *t;
-    uint16_t *d = display_dat[y];
-
-    memset(d, 0, sizeof(display_dat[0]));
-
-    /* Top two lines are blank. */
-    y -= 2;
-
-    /* Work out which text row we are on. */
-    for (row = 0; row < display->rows; row++) {
-        int nr = (display->heights & (1u<<row)) ? 16 : 8;
-        if (y < 0)
-            return;
-        if (y < nr)
-            break;
-        y -= nr + 2; /* Two blank lines between each row of text. */
+    struct osd_frame *f = stream_frame;
+    while ((stream_render_y < f->text_height)
+           && (stream_render_y < (stream_y + LINE_RING))) {
+        render_line(line_ring[stream_render_y & (LINE_RING-1)],
+                    stream_render_y, &f->snap);
+        stream_render_y++;
     }
+}
 
-    /* Done all rows? Final two lines are blank. */
-    if (row >= display->rows)
-        return;
+/* Width of the OSD box in TIM1 ticks, for @cols characters: 
+ * [ticks per pixel] x [8 pixels per character] x [@cols characters] 
+ * + [allowance for OSD box lead-in and lead-out] */
+static uint16_t osd_box_ticks(int cols)
+{
+    const struct video_timing *t = &video_timings[running_display_timing];
+    return t->spi[startup_display_spi].tpp * 8 * cols
+        + t->spi[startup_display_spi].pad;
+}
 
-    /* If this is a double-height row, each pixel line is repeated. */
-    if (display->heights & (1u<<row))
-        y /= 2;
+/* Render @display into the back buffer and publish it, if it differs from 
+ * the front buffer. Only dirty text rows are re-rendered, unless the back
+ * buffer holds a different display or layout. */
+static void osd_update(struct display *display)
+{
+    struct osd_frame *front = osd_front, *back = osd_back;
+    unsigned int row, i, y;
+    uint16_t height;
+    uint8_t dirty;
+    bool_t dbl_y = (config.display_2Y == DISP_2Y_DOUBLE), fields, stream;
+
+    /* Back buffer is still waiting to be swapped in? */
+    if (osd_pending)
+        return;
 
-    t = display->text[row];
+    dirty = display->dirty;
+    display->dirty = 0;
+    osd_frames[0].dirty |= dirty;
+    osd_frames[1].dirty |= dirty;
+
+    /* Height depends on #rows and height of each row. */
+    height = display->rows*10+2;
+    for (row = 0; row < display->rows; row++)
+        if (display->heights & (1u<<row))
+            height += 8;
+    if (display->bitmap_height)
+        height = display->bitmap_height;
+    stream = !display->bitmap_height && (height > MAX_DISPLAY_HEIGHT);
+    fields = ((config.display_2Y == DISP_2Y_FIELD) && interlaced()
+              && !stream);
+
+    /* Nothing to do if the front buffer is up to date. */
+    if ((display == front->display)
+        && ((display->bitmap_height ? display->bitmap : front->dat)
+            == front->lines)
+        && (height == front->text_height)
+        && (display->rows == front->rows)
+        && (display->cols == front->cols)
+        && (display->heights == front->heights)
+        && (display->on == front->on)
+        && (dbl_y == front->dbl_y)
+        && (fields == front->fields)
+        && (osd_box_ticks(display->cols) == front->box_ticks)
+        && !front->dirty)
+        return;
 
-    for (x = 0; x < display->cols; x++) {
-        uint8_t c = *t++;
-        if ((c < 0x20) || (c > 0x7f))
-            c = 0x20;
-        c -= 0x20;
-        d[x/2] |= (uint16_t)font[(c<<3)+y] << ((x&1)?0:8);
+    if (display->bitmap_height) {
+        /* Bitmap: Scanned out directly, nothing to render. */
+    } else if (stream) {
+        /* Too tall for a frame buffer: Stream it from a snapshot. */
+        back->snap = *display;
+    } else if ((display == back->display)
+               && !back->stream
+               && (back->lines == back->dat)
+               && (display->rows == back->rows)
+               && (display->cols == back->cols)
+               && (display->heights == back->heights)) {
+        /* Same layout: Only pixel lines of dirty rows need to be redrawn. */
+        y = 2;
+        for (row = 0; row < display->rows; row++) {
+            unsigned int nr = (display->heights & (1u<<row)) ? 16 : 8;
+            if (back->dirty & (1u<<row))
+                for (i = y; i < y+nr; i++)
+                    render_line(back->dat[i], i, display);
+            y += nr + 2;
+        }
+    } else {
+        for (y = 0; y < height; y++)
+            render_line(back->dat[y], y, display);
     }
+
+    back->display = display;
+    back->rows = display->rows;
+    back->cols = display->cols;
+    back->heights = display->heights;
+    back->dirty = 0;
+    back->on = display->on;
+    back->dbl_y = dbl_y;
+    back->fields = fields;
+    back->stream = stream;
+    back->text_height = height;
+    back->height = (!display->on ? 0 : dbl_y ? 2*height
+                    : fields ? height/2 : height);
+    back->box_ticks = osd_box_ticks(display->cols);
+    back->lines = display->bitmap_height ? display->bitmap : back->dat;
+    if (!stream)
+        for (i = 0; i < back->height; i++)
+            back->cmar[i] = (uint32_t)(unsigned long)
+                back->lines[dbl_y ? i/2 : fields ? 2*i : i];
+    if (fields)
+        for (i = 0; i < back->height; i++)
+            back->cmar[back->height + i] = (uint32_t)(unsigned long)
+                back->lines[2*i + 1];
+
+    barrier(); /* Fill the back buffer /then/ publish it */
+    osd_pending = TRUE;
 }
 
 /* Keypress action notifier. */
@@ -622,6 +946,7 @@ static void update_amiga_keys(void)
         notify.cols = strlen((char *)notify.text[0]);
         notify.rows = 1;
         notify.on = TRUE;
+        notify.dirty = 0xff;
         notify_time = time_now();
     }
 
@@ -658,6 +983,7 @@ static void update_amiga_keys(void)
                 p += len + 1;
             }
             notify.on = TRUE;
+            notify.dirty = 0xff;
             notify_time = time_now();
         }
     }
@@ -704,118 +1030,162 @@ static void emulate_gotek_buttons(void)
  * Flash updates can stall instruction fetch and mess up the OSD. */
 void display_off(void)
 {
-    display_height = 0; /* Display off */
+    int i;
+    display_blank = TRUE; /* Display off */
+    /* Let a DMA-chain box run to completion (up to 2*MAX_BOX_HEIGHT 
+     * lines). Its end-of-box IRQ must not be stalled by the Flash update. */
+    for (i = 0; osd_chain_active && (i < 20); i++)
+        delay_ms(1);
     delay_us(500);      /* Wait for a few hlines (we only really need one) */
 }
 
-void setup_spi1(void)
+/* Switch to video timing @timing: SPI pixel clock and timers together. */
+static void setup_timing(unsigned int timing)
 {
-    /* Configure SPI: 16-bit mode, MSB first, CPOL Low, CPHA Leading Edge. */
-    /* SPI1 is on APB2 which runs at 72MHz */
-    spi_display_spi1->cr2 = SPI_CR2_TXDMAEN;
-    switch (running_display_timing) {
-        case DISP_VGA:
-            spi_display_spi1->cr1 = (SPI_CR1_MSTR | /* master */
-                            SPI_CR1_SSM | SPI_CR1_SSI | /* software NSS */
-                            SPI_CR1_SPE | /* enable */
-                            SPI_CR1_DFF | /* 16-bit */
-                            SPI_CR1_CPHA |
-                            SPI_CR1_BR_DIV2); /* 72MHz/2 = 36MHz */
-            break;
-
-        case DISP_15KHZ:
-        default:
-            spi_display_spi1->cr1 = (SPI_CR1_MSTR | /* master */
-                            SPI_CR1_SSM | SPI_CR1_SSI | /* software NSS */
-                            SPI_CR1_SPE | /* enable */
-                            SPI_CR1_DFF | /* 16-bit */
-                            SPI_CR1_CPHA |
-                            SPI_CR1_BR_DIV8); /* 72MHz/8 = 9MHz */
-            break;
-    }
-}
+    const struct video_timing *t = &video_timings[timing];
+    unsigned int tpp = t->spi[startup_display_spi].tpp;
 
-void setup_spi2(void)
-{
-    /* Configure SPI: 16-bit mode, MSB first, CPOL Low, CPHA Leading Edge. */
-    /* SPI2 is on APB1 which runs at 36MHz */
-    spi_display_spi2->cr2 = SPI_CR2_TXDMAEN;
-    switch (running_display_timing) {
-        case DISP_VGA:
-            spi_display_spi2->cr1 = (SPI_CR1_MSTR | /* master */
-                            SPI_CR1_SSM | SPI_CR1_SSI | /* software NSS */
-                            SPI_CR1_SPE | /* enable */
-                            SPI_CR1_DFF | /* 16-bit */
-                            SPI_CR1_CPHA |
-                            SPI_CR1_BR_DIV2); /* 36MHz/2 = 18MHz */
-            break;
-
-        case DISP_15KHZ:
-        default:
-            spi_display_spi2->cr1 = (SPI_CR1_MSTR | /* master */
-                            SPI_CR1_SSM | SPI_CR1_SSI | /* software NSS */
-                            SPI_CR1_SPE | /* enable */
-                            SPI_CR1_DFF | /* 16-bit */
-                            SPI_CR1_CPHA |
-                            SPI_CR1_BR_DIV4); /* 36MHz/4 = 9MHz */
-            break;
+    running_display_timing = timing;
+    running_timing_name = t->name;
+
+    /* Configure SPI: 16-bit mode, MSB first, CPOL Low, CPHA Leading Edge. 
+     * SPI1 is on APB2 (72MHz), SPI2 on APB1 (36MHz): Divide down to 
+     * SYSCLK/tpp. */
+    if (startup_display_spi == DISP_SPI1) {
+        spi_display_spi1->cr2 = SPI_CR2_TXDMAEN;
+        spi_display_spi1->cr1 = (SPI_CR1_MSTR | /* master */
+                                 SPI_CR1_SSM | SPI_CR1_SSI | /* soft NSS */
+                                 SPI_CR1_SPE | /* enable */
+                                 SPI_CR1_DFF | /* 16-bit */
+                                 SPI_CR1_CPHA |
+                                 ((__builtin_ctz(tpp) - 1) << 3));
+    } else {
+        spi_display_spi2->cr2 = SPI_CR2_TXDMAEN;
+        spi_display_spi2->cr1 = (SPI_CR1_MSTR | /* master */
+                                 SPI_CR1_SSM | SPI_CR1_SSI | /* soft NSS */
+                                 SPI_CR1_SPE | /* enable */
+                                 SPI_CR1_DFF | /* 16-bit */
+                                 SPI_CR1_CPHA |
+                                 ((__builtin_ctz(tpp) - 2) << 3));
     }
+
+    slave_arr_update();
 }
 
+/* Switch to fixed timing @video_mode (DISP_15KHZ or DISP_VGA). */
 void setup_spi(uint16_t video_mode)
 {
-    running_display_timing = video_mode;
-
-    if (startup_display_spi == DISP_SPI1)
-        setup_spi1();
-    else
-        setup_spi2();
-
-    slave_arr_update();
+    setup_timing((video_mode == DISP_VGA) ? TIMING_VGA60 : TIMING_PAL);
 }
 
 static time_t auto_time;
+/* Called every frame: Follow the estimator's locked line period. */
 void do_autosync(void)
 {
-    unsigned int avg_hz;
-    time_t avg_sync_time;
-    bool_t valid_sync_data;
-    int i;
+    unsigned int lines, timing, period = autosync.period;
 
-    avg_sync_time = 0;
-    for (i = 0; i < sync_log_MAX; i++)
-        avg_sync_time += sync_log[i];
-    avg_sync_time /= sync_log_MAX;
-
-    /* Require all samples to be +/- 10/9,000,000th from average */
-    valid_sync_data = (avg_sync_time != 0);
-    for (i = 0; i < sync_log_MAX; i++) {
-        int diff = sync_log[i] - avg_sync_time;
-        if ((diff > 10) || (diff < -10))
-            valid_sync_data = FALSE;
-    }
-    if (!valid_sync_data)
+    if (!period)
         return;
 
-    /* 9MHz clock, 15.625kHz => 576 => PAL/NTSC
-     * 9MHz clock, 20.000kHz => 450 => my threshold
-     * 9MHz clock, 39.130kHz => 230 => VGA */
-    avg_hz = 9000000 / avg_sync_time; /* sync time -> frequency in Hz */
-    if ((avg_hz < 20000)
-        && (running_display_timing != DISP_15KHZ)) {
-        /* PAL/NTSC */
-#ifndef NDEBUG
-        printk("Switch to PAL/NTSC: %d Hz < 20kHz\n", avg_hz);
-#endif
-        setup_spi(DISP_15KHZ);
-    } else if ((avg_hz >= 20000)
-               && (running_display_timing != DISP_VGA)) {
-        /* VGA */
+    /* Lines per frame follow from the frame and line periods. */
+    lines = (frame_cycles + period/2) / period;
+    timing = timing_detect(period, lines);
+    if (timing != running_display_timing) {
 #ifndef NDEBUG
-        printk("Switch to VGA: %d Hz > 20kHz\n", avg_hz);
+        printk("Switch to %s: %u Hz, %u lines (lock in %u frames)\n",
+               video_timings[timing].name, SYSCLK / period, lines,
+               autosync.latency);
 #endif
-        setup_spi(DISP_VGA);
+        setup_timing(timing);
+    }
+}
+
+/* Last warm-start record written to Flash. */
+static struct warm_start warm;
+static bool_t warm_valid;
+
+/* Resume in the video timing and polarity we last locked to. */
+static bool_t warm_start_init(void)
+{
+    /* No OSD yet: Erase ahead if the log is full. */
+    warm_start_flush();
+
+    if (!warm_start_read(&warm)
+        || (warm.timing >= TIMING_MAX)
+        || (warm.polarity > SYNC_HIGH))
+        return FALSE;
+
+    warm_valid = TRUE;
+    printk("Warm start: %s, active %s\n", video_timings[warm.timing].name,
+           warm.polarity ? "HIGH" : "LOW");
+
+    if (config.polarity == SYNC_AUTO) {
+        running_polarity = detected_polarity = warm.polarity;
+        pol_conf = warm.polarity ? POL_DECIDE : -POL_DECIDE;
+        pol_decided = TRUE;
     }
+
+    if (config.display_timing != DISP_AUTO)
+        return FALSE;
+    autosync.period = warm.period;
+    setup_timing(warm.timing);
+    return TRUE;
+}
+
+/* Called once a second: Stage a new locked mode once it has been stable 
+ * for a second, and differs from the one already recorded. It is appended 
+ * to Flash below the OSD box of the next frame. */
+static void warm_start_update(bool_t locked)
+{
+    static struct warm_start prev;
+    struct warm_start ws;
+
+    if (!locked || !pol_decided || !autosync.period
+        || ((config.display_timing != DISP_AUTO)
+            && (config.polarity != SYNC_AUTO)))
+        return;
+
+    ws.timing = running_display_timing;
+    ws.polarity = running_polarity;
+    ws.period = autosync.period;
+
+    if ((ws.timing != prev.timing) || (ws.polarity != prev.polarity)
+        || (ws.period != prev.period)) {
+        prev = ws;
+        return;
+    }
+
+    if (warm_valid && (ws.timing == warm.timing)
+        && (ws.polarity == warm.polarity) && (ws.period == warm.period))
+        return;
+
+    printk("Warm start: Staging %s, active %s\n",
+           video_timings[ws.timing].name, ws.polarity ? "HIGH" : "LOW");
+    warm = ws;
+    warm_valid = TRUE;
+    warm_start_stage(&warm);
+}
+
+/* Update the I2C telemetry registers, @elapsed ticks since the last update. 
+ * Rates are averaged over that period. */
+static void status_update(time_t elapsed, bool_t locked)
+{
+    static uint32_t frames;
+    struct i2c_osd_status *s = &i2c_osd_status;
+    uint32_t nr = s->frames - frames;
+    unsigned int period = autosync.period;
+
+    frames = s->frames;
+    s->line_hz = (locked && period) ? SYSCLK / period : 0;
+    s->frame_chz = nr * 1000000 / max_t(time_t, elapsed / time_us(100), 1);
+    s->irq_load = sync_cycles_frame * nr / sysclk_ms(1);
+    s->flags = ((locked ? OSD_STATUS_LOCKED : 0)
+                | (running_polarity ? OSD_STATUS_POL_HIGH : 0)
+                | (osd_dma_chain ? OSD_STATUS_DMA_CHAIN : 0)
+                | (interlaced() ? OSD_STATUS_INTERLACE : 0));
+    s->display_timing = running_display_timing;
+    s->polarity_conf = pol_conf;
+    s->polarity_latency = pol_latency;
 }
 
 int main(void)
@@ -837,7 +1207,7 @@ int main(void)
     stm32_init();
     time_init();
     console_init();
-    i2c_init();
+    font_init();
 
     /* PC13: Blue Pill Indicator LED (Active Low) */
     gpio_configure_pin(gpioc, 13, GPI_pull_up);
@@ -858,6 +1228,7 @@ int main(void)
     gpio_configure_pin(gpioa, 5, GPO_opendrain(_2MHz, LOW));
 
     config_init();
+    i2c_init();
     startup_display_spi = config.display_spi;
     startup_dispctl_mode = config.dispctl_mode;
     running_polarity = SYNC_LOW;
@@ -881,10 +1252,9 @@ int main(void)
     else
         dma_display_spi2.cpar = (uint32_t)(unsigned long)&spi_display_spi2->dr;
 
-    if (config.display_timing != DISP_AUTO)
-        setup_spi(config.display_timing);
-    else
-        setup_spi(DISP_15KHZ);
+    if (!warm_start_init())
+        setup_spi((config.display_timing != DISP_AUTO)
+                  ? config.display_timing : DISP_15KHZ);
 
     /* PA8 -> EXTI8 ; PB14 -> EXTI14 */
     afio->exticr4 |= 0x0100;
@@ -896,29 +1266,25 @@ int main(void)
         tim2_up_dma.cpar = (uint32_t)(unsigned long)&dma_display_spi1.ccr;
     else
         tim2_up_dma.cpar = (uint32_t)(unsigned long)&dma_display_spi2.ccr;
-    tim2_up_dma.cmar = (uint32_t)(unsigned long)&dma_display_ccr;
-    tim2_up_dma.cndtr = 1;
-    tim2_up_dma.ccr = (DMA_CCR_PL_V_HIGH |
-                       DMA_CCR_MSIZE_16BIT |
-                       DMA_CCR_PSIZE_32BIT |
-                       DMA_CCR_CIRC |
-                       DMA_CCR_DIR_M2P |
-                       DMA_CCR_EN);
+    tim2_up_dma.cmar = (uint32_t)(unsigned long)dma_display_ccr;
     setup_slave_timer(tim2);
 
-    /* Timer 4 is triggered by Timer 1. On overflow it triggers DMA
-     * to enable the OSD box. */
+    /* Timer 4 is triggered by Timer 1. On Ch.1 compare (at ARR) it triggers 
+     * DMA to enable the OSD box. CC1E stays clear: TIM4_CH1 shares pin PB6 
+     * with I2C1 SCL. */
     setup_dispctl_mode();
-    tim4_up_dma.cpar = dispctl_reg;
-    tim4_up_dma.cmar = (uint32_t)(unsigned long)&dispctl_on;
-    tim4_up_dma.cndtr = 1;
-    tim4_up_dma.ccr = (DMA_CCR_PL_V_HIGH |
-                       DMA_CCR_MSIZE_32BIT |
-                       DMA_CCR_PSIZE_32BIT |
-                       DMA_CCR_CIRC |
-                       DMA_CCR_DIR_M2P |
-                       DMA_CCR_EN);
+    tim4_ch1_dma.cpar = dispctl_reg;
+    tim4_ch1_dma.cmar = (uint32_t)(unsigned long)&dispctl_on;
+    tim4_ch1_dma.cndtr = 1;
+    tim4_ch1_dma.ccr = (DMA_CCR_PL_V_HIGH |
+                        DMA_CCR_MSIZE_32BIT |
+                        DMA_CCR_PSIZE_32BIT |
+                        DMA_CCR_CIRC |
+                        DMA_CCR_DIR_M2P |
+                        DMA_CCR_EN);
     setup_slave_timer(tim4);
+    tim4->ccmr1 = TIM_CCMR1_CC1S(TIM_CCS_OUTPUT);
+    tim4->dier = TIM_DIER_CC1DE;
 
     /* Timer 2 interrupts us horizontally just before the OSD box, so that 
      * we can pause I2C IRQ transfers. */
@@ -937,14 +1303,7 @@ int main(void)
     /* Timer 1 Channel 3 is used to disable the OSD box. */
     tim1_ch3_dma.cpar = dispctl_reg;
     tim1_ch3_dma.cmar = (uint32_t)(unsigned long)&dispctl_off;
-    tim1_ch3_dma.cndtr = 1;
-    tim1_ch3_dma.ccr = (DMA_CCR_PL_V_HIGH |
-                        DMA_CCR_MSIZE_32BIT |
-                        DMA_CCR_PSIZE_32BIT |
-                        DMA_CCR_CIRC |
-                        DMA_CCR_DIR_M2P |
-                        DMA_CCR_TCIE |
-                        DMA_CCR_EN);
+    osd_irq_dma_setup();
     tim1->ccmr2 = TIM_CCMR2_CC3S(TIM_CCS_OUTPUT);
     tim1->dier = TIM_DIER_CC3DE;
     tim2->cr2 = TIM_CR2_MMS(2); /* UEV -> TRGO */
@@ -956,6 +1315,7 @@ int main(void)
     tim1->ccer |= TIM_CCER_CC4E;
 
     set_polarity();
+    sync_capture_start();
 
     amiga_init();
 
@@ -969,6 +1329,11 @@ int main(void)
         IRQx_enable(irqs[i]);
     }
 
+    IRQx_set_prio(irq_render, RENDER_IRQ_PRI);
+    IRQx_enable(irq_render);
+
+    quiesce_init();
+
     frame_time = auto_time = time_now();
     lost_sync = FALSE;
 
@@ -980,41 +1345,55 @@ int main(void)
 
         canary_check();
 
-        /* Wait while displaying OSD box. This avoids modifying config values 
-         * etc during the critical display period, which could cause
-         * glitches. */
-        for (i = 0; i < 5; i++) { /* up to 5ms */
-            if (hline < (vstart - 3))
-                break;
-            delay_ms(1);
-        }
-
         /* Check for losing sync: no valid frame in over 100ms. We repeat the 
          * forced reset every 100ms until sync is re-established. */
         if (time_diff(frame_time, time_now()) > time_ms(100)) {
-            if (!lost_sync)
+            if (!lost_sync) {
                 printk("Sync lost\n");
+                i2c_osd_status.sync_losses++;
+            }
             lost_sync = TRUE;
             frame_time = time_now();
             IRQ_global_disable();
+            line_count_stop();
+            osd_chain_stop();
             tim1->smcr = 0;
+            tim2->dier &= ~TIM_DIER_UIE;
+            irq_unquiesce();
             hline = HLINE_EOF;
+            sync_capture_start();
             IRQ_global_enable();
+            /* No OSD without sync: A quiet point for Flash erase. */
+            warm_start_flush();
         }
 
         if (time_diff(auto_time, time_now()) > time_ms(1000)) {
+            status_update(time_diff(auto_time, time_now()), !lost_sync);
+            warm_start_update(!lost_sync);
             auto_time = time_now();
-            if (config.display_timing == DISP_AUTO)
-                do_autosync();
 
-            if (config.polarity == SYNC_AUTO) {
 #ifndef NDEBUG
-                printk ("%d high %d low %d\n", sync_sum_ptr, sync_sum_high, sync_sum_low );
-                if (running_polarity != detected_polarity)
-                    printk("Polarity to active %s\n",detected_polarity ? "HIGH" : "LOW");
+            printk("Sync IRQs: %u cycles/frame (%s)\n", sync_cycles_frame,
+                   osd_dma_chain ? "DMA chain" : "IRQ");
+            printk("I2C: %u IRQs, %u transactions\n",
+                   i2c_irqs, i2c_transactions);
+            printk("I2C: Dropped %u transactions, %u bytes; "
+                   "peak %u bytes\n", i2c_dropped_transactions,
+                   i2c_dropped_bytes, i2c_osd_info.peak_bytes);
+            printk("Polarity: confidence %d, last decided in %u edges\n",
+                   pol_conf, pol_latency);
 #endif
-                running_polarity = detected_polarity;
-            }
+        }
+
+        /* Follow the polarity detector as soon as it decides. Sync edge 
+         * triggers are switched over at start of the next frame. */
+        if ((config.polarity == SYNC_AUTO)
+            && (running_polarity != detected_polarity)) {
+#ifndef NDEBUG
+            printk("Polarity to active %s\n",
+                   detected_polarity ? "HIGH" : "LOW");
+#endif
+            running_polarity = detected_polarity;
         }
 
         /* Keyboard hold/release notifier? */
@@ -1025,6 +1404,7 @@ int main(void)
             notify.cols = strlen((char *)notify.text[0]);
             notify.rows = 1;
             notify.on = TRUE;
+            notify.dirty = 0xff;
             notify_time = time_now();
             _keyboard_held = keyboard_held;
         }
@@ -1032,74 +1412,37 @@ int main(void)
         /* Have we just finished generating a frame? */
         if (frame) {
 
-            uint16_t height;
-
             if (lost_sync) {
                 printk("Sync found\n");
                 lost_sync = FALSE;
             }
 
             frame_time = time_now();
+            i2c_osd_status.frames += frame;
+            i2c_marquee_tick(frame);
+            if (config.display_timing == DISP_AUTO)
+                do_autosync();
             frame = 0;
+            display_blank = FALSE;
 
-            /* Work out what to display next frame. */
-            cur_display = config_active ? &config_display
-                : osd_on ? &i2c_display : &no_display;
-            if (notify.on) {
-                if (time_diff(notify_time, time_now()) > time_ms(2000)) {
-                    notify.on = FALSE;
-                } else {
-                    cur_display = &notify;
-                }
-            }
+            /* Below the OSD box: Time to append a staged warm-start record 
+             * before the box starts again. */
+            if (hline == HLINE_EOF)
+                warm_start_append();
 
-            /* Next frame height depends on #rows and height of each row. */
-            height = cur_display->rows*10+2;
-            for (i = 0; i < cur_display->rows; i++)
-                if (cur_display->heights & (1<<i))
-                    height += 8;
-            height = min_t(uint16_t, height, MAX_DISPLAY_HEIGHT);
-
-            /* Render to the SPI DMA buffer. */
-            for (i = 0; i < height; i++)
-                render_line(i, cur_display);
-            if (cur_display->on) {
-                /* [2 ticks per pixel (at SPI 36MHz rate)]
-                 * x [8 pixels per character] x [@cols characters]
-                 * + [allowance for OSD box lead-in and lead-out] */
-
-                /* [4 ticks per pixel (at SPI 18MHz rate)]
-                 * x [8 pixels per character] x [@cols characters]
-                 * + [allowance for OSD box lead-in and lead-out] */
-
-                switch (running_display_timing) {
-                case DISP_VGA:
-                    if (startup_display_spi == DISP_SPI1)
-                        tim1->ccr3 = 2 * 8 * cur_display->cols + 36;
-                    else
-                        tim1->ccr3 = 4 * 8 * cur_display->cols + 54;
-                break;
-
-                /* [8 ticks per pixel (at SPI 9MHz rate)]
-                 * x [8 pixels per character] x [@cols characters]
-                 * + [allowance for OSD box lead-in and lead-out] */
-                case DISP_15KHZ:
-                default:
-                    tim1->ccr3 = 8 * 8 * cur_display->cols + 80;
-                break;
-                }
+        }
 
-                tim1->ccr4 = tim1->ccr3 - sysclk_us(1);
-                barrier(); /* Set post-OSD timeout /then/ enable display */
-                if (config.display_2Y)
-                    display_height = 2*height;
-                else
-                    display_height = height;
+        /* Work out what to display next frame. */
+        cur_display = config_active ? &config_display
+            : osd_on ? &i2c_display : &no_display;
+        if (notify.on) {
+            if (time_diff(notify_time, time_now()) > time_ms(2000)) {
+                notify.on = FALSE;
             } else {
-                display_height = 0;
+                cur_display = &notify;
             }
-
         }
+        osd_update(cur_display);
 
         update_amiga_keys();
         emulate_gotek_buttons();
@@ -0,0 +1,107 @@
+/*
+ * render.c
+ * 
+ * Render OSD text into pixel lines for SPI scanout.
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include "font.h"
+
+/* Render tables: The font transposed so that each pixel line of all glyphs 
+ * is contiguous, and maps from character code to glyph (unprintable 
+ * characters map to space). The eight user-defined glyphs follow the font, 
+ * so they render at the same cost. Only displays with user_glyphs map codes 
+ * 0x00-0x0f to them: Elsewhere NUL is padding. */
+#define NR_GLYPHS (sizeof(font)/8)
+#define NR_USER_GLYPHS 8
+static uint8_t font_t[8][NR_GLYPHS + NR_USER_GLYPHS];
+static uint8_t glyph_map[2][256];
+
+void font_init(void)
+{
+    unsigned int c, y;
+
+    for (c = 0; c < NR_GLYPHS; c++)
+        for (y = 0; y < 8; y++)
+            font_t[y][c] = font[c*8+y];
+
+    for (c = 0; c < ARRAY_SIZE(glyph_map[0]); c++) {
+        glyph_map[0][c] = ((c < 0x20) || (c > 0x7f)) ? 0 : c - 0x20;
+        glyph_map[1][c] = (c < 0x10) ? NR_GLYPHS + (c & 7) : glyph_map[0][c];
+    }
+}
+
+void font_write_cgram(unsigned int addr, uint8_t bits)
+{
+    /* Five pixels wide, aligned with the built-in font's glyphs. */
+    font_t[addr & 7][NR_GLYPHS + ((addr >> 3) & 7)] = (bits & 0x1f) << 2;
+}
+
+void render_line(uint16_t *d, int y, const struct display *display)
+{
+    unsigned int x = 0, row, cols;
+    const uint8_t *t, *f, *map = glyph_map[!!display->user_glyphs];
+
+    /* Top two lines are blank. */
+    y -= 2;
+
+    /* Work out which text row we are on. */
+    for (row = 0; row < display->rows; row++) {
+        int nr = (display->heights & (1u<<row)) ? 16 : 8;
+        if (y < 0)
+            goto out;
+        if (y < nr)
+            break;
+        y -= nr + 2; /* Two blank lines between each row of text. */
+    }
+
+    /* Done all rows? Final two lines are blank. */
+    if (row >= display->rows)
+        goto out;
+
+    /* If this is a double-height row, each pixel line is repeated. */
+    if (display->heights & (1u<<row))
+        y /= 2;
+
+    t = display->text[row];
+    f = font_t[y];
+    cols = display->cols;
+
+    if (display->shift[row]) {
+        /* Marquee: Each word is a pair of characters shifted left, drawing 
+         * in pixels from the character that follows. */
+        unsigned int s = 8 - display->shift[row];
+        for (x = 0; x < (cols+1)/2; x++, t += 2) {
+            uint32_t w = (f[map[t[0]]] << 16) | (f[map[t[1]]] << 8);
+            if (2*x+2 < ARRAY_SIZE(display->text[0]))
+                w |= f[map[t[2]]];
+            d[x] = w >> s;
+        }
+        if (cols & 1)
+            d[x-1] &= 0xff00;
+        goto out;
+    }
+
+    /* Each 16-bit SPI word is a pair of characters, written whole. */
+    for (x = 0; x < cols/2; x++, t += 2)
+        d[x] = (f[map[t[0]]] << 8) | f[map[t[1]]];
+    if (cols & 1)
+        d[x++] = f[map[t[0]]] << 8;
+
+out:
+    /* Blank to end of line. */
+    for (; x < LINE_WORDS; x++)
+        d[x] = 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,66 @@
+/*
+ * ring.c
+ * 
+ * Single-producer/single-consumer ring buffers.
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+void ring_push_commit(struct ring *r, unsigned int n)
+{
+    unsigned int used;
+
+    barrier(); /* Write elements /then/ publish them */
+    r->prod += n;
+
+    used = ring_used(r);
+    if (used > r->size) {
+        /* Overran the consumer. */
+        r->overflows += min_t(unsigned int, n, used - r->size);
+        used = r->size;
+    }
+    if (used > r->hwm)
+        r->hwm = used;
+}
+
+unsigned int __ring_push(struct ring *r, void *arr, const void *src,
+                         unsigned int n, unsigned int esz)
+{
+    unsigned int i, nr, done = 0;
+
+    while ((done < n) && ((nr = ring_reserve(r, &i)) != 0)) {
+        nr = min_t(unsigned int, nr, n - done);
+        memcpy((char *)arr + i*esz, (const char *)src + done*esz, nr*esz);
+        ring_push_commit(r, nr);
+        done += nr;
+    }
+
+    r->overflows += n - done;
+    return done;
+}
+
+unsigned int __ring_pop(struct ring *r, const void *arr, void *dst,
+                        unsigned int n, unsigned int esz)
+{
+    unsigned int i, nr, done = 0;
+
+    while ((done < n) && ((nr = ring_peek(r, &i)) != 0)) {
+        nr = min_t(unsigned int, nr, n - done);
+        memcpy((char *)dst + done*esz, (const char *)arr + i*esz, nr*esz);
+        ring_pop_commit(r, nr);
+        done += nr;
+    }
+
+    return done;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -109,6 +109,11 @@ static void clock_init(void)
     /* Enable SysTick counter at 72/8=9MHz. */
     stk->load = STK_MASK;
     stk->ctrl = STK_CTRL_ENABLE;
+
+    /* Enable DWT cycle counter at 72MHz (for profiling). */
+    dbg->demcr |= DBG_DEMCR_TRCENA;
+    dwt->cyccnt = 0;
+    dwt->ctrl |= DWT_CTRL_CYCCNTENA;
 }
 
 static void gpio_init(GPIO gpio)
@@ -0,0 +1,434 @@
+/*
+ * sync.c
+ * 
+ * Display sync: Track frames and lines from CSYNC/HSYNC and VSYNC edges. 
+ * The OSD box itself is generated by main.c, from the lines handed back by 
+ * sync_csync().
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+extern uint16_t running_polarity, detected_polarity;
+extern volatile unsigned int vstart;
+extern uint16_t running_display_timing;
+
+int hline, frame;
+
+#define LINE_HZ(hz, pct)                                \
+    .min_period = SYSCLK / ((hz) + (hz)*(pct)/100),     \
+    .max_period = SYSCLK / ((hz) - (hz)*(pct)/100)
+#define LINES(min, max) .min_lines = (min), .max_lines = (max)
+
+/* 15kHz: 9MHz pixels on either SPI. */
+#define SCAN_15KHZ .h_scale = 20, .v_scale = 1,                 \
+        .spi = { [DISP_SPI2] = { 8, 49, 80 }, [DISP_SPI1] = { 8, 49, 80 } }
+/* 24kHz: 18MHz pixels on either SPI, so the SPI lead-in and padding are 
+ * those of 31kHz on SPI2. The box position scales are placeholders, not 
+ * yet checked on a 24kHz display: h_scale interpolates the h_off step of 
+ * the other modes by line period (20 x 15.6/24.5 = 12.8 from 15kHz, 
+ * 7 x 31.5/24.5 = 9.0 from 31kHz), and v_scale is the smallest which lets 
+ * v_off (up to 299) reach the last line of the frame (460). */
+#define SCAN_24KHZ .h_scale = 11, .v_scale = 2,                 \
+        .spi = { [DISP_SPI2] = { 4, 24, 54 }, [DISP_SPI1] = { 4, 24, 54 } }
+/* 31kHz: 18MHz pixels on SPI2, 36MHz on SPI1. */
+#define SCAN_31KHZ .h_scale = 7, .v_scale = 2,                  \
+        .spi = { [DISP_SPI2] = { 4, 24, 54 }, [DISP_SPI1] = { 2, 12, 36 } }
+
+const struct video_timing video_timings[TIMING_MAX] = {
+    [TIMING_PAL] = { "PAL", LINE_HZ(15625, 3), LINES(300, 330),
+                     SCAN_15KHZ },
+    [TIMING_NTSC] = { "NTSC", LINE_HZ(15734, 3), LINES(250, 275),
+                      SCAN_15KHZ },
+    [TIMING_24KHZ] = { "24kHz", LINE_HZ(24500, 8), LINES(380, 460),
+                       SCAN_24KHZ },
+    [TIMING_VGA70] = { "VGA 70Hz", LINE_HZ(31469, 3), LINES(440, 460),
+                       SCAN_31KHZ },
+    /* 480p has the same line and frame timings as 640x480 VGA. */
+    [TIMING_VGA60] = { "VGA/480p", LINE_HZ(31469, 3), LINES(515, 535),
+                       SCAN_31KHZ },
+};
+
+/* Find the video timing which best matches @period (SYSCLK ticks) and 
+ * @lines per frame. Else the running timing, or the first, with a matching 
+ * line period. Else the one with the nearest line period. */
+unsigned int timing_detect(unsigned int period, unsigned int lines)
+{
+    const struct video_timing *t;
+    unsigned int i, mid, diff, best_diff = ~0u;
+    int match = -1, nearest = 0;
+
+    for (i = 0; i < TIMING_MAX; i++) {
+        t = &video_timings[i];
+        if ((period >= t->min_period) && (period <= t->max_period)) {
+            if ((lines >= t->min_lines) && (lines <= t->max_lines))
+                return i;
+            if ((match < 0) || (i == running_display_timing))
+                match = i;
+        }
+        mid = (t->min_period + t->max_period) / 2;
+        diff = (period > mid) ? period - mid : mid - period;
+        if (diff < best_diff) {
+            best_diff = diff;
+            nearest = i;
+        }
+    }
+
+    return (match >= 0) ? match : nearest;
+}
+
+/* TIM1 is timestamping sync edges? (See sync_capture_start().) */
+static bool_t sync_capture_active;
+
+/* TIM1 timestamp of the last start of sync, while timestamping. */
+static uint16_t sync_start;
+static bool_t sync_start_valid;
+
+void set_polarity(void)
+{
+    if (running_polarity) {
+        /* Active High: Rising edge = sync start */
+        exti->ftsr &= ~(m(pin_csync) | m(pin_vsync));
+        exti->rtsr |= m(pin_csync) | m(pin_vsync); /* Rising edge */
+    } else {
+        /* Active Low: Falling edge = sync start */
+        exti->rtsr &= ~(m(pin_csync) | m(pin_vsync));
+        exti->ftsr |= m(pin_csync) | m(pin_vsync); /* Falling edge */
+    }
+
+    /* TIM1 capture edges are fixed while timestamping. */
+    if (sync_capture_active)
+        return;
+    if (running_polarity)
+        tim1->ccer |= TIM_CCER_CC1P | TIM_CCER_CC2P; /* Falling edge */
+    else
+        tim1->ccer &= ~(TIM_CCER_CC1P | TIM_CCER_CC2P); /* Rising edge */
+}
+
+/* Sync edge timestamps: Between end of OSD box and the first line of the 
+ * next frame, TIM1 is otherwise idle. It free-runs at SYSCLK, and Ch.1 and 
+ * Ch.2 capture every rising and falling edge of CSYNC respectively. Sync 
+ * measurements are then free of IRQ latency. No TRGO, else TIM2 and TIM4 
+ * would be triggered on each overflow. */
+void sync_capture_start(void)
+{
+    tim1->cr1 = 0;
+    tim1->dier = 0;
+    tim1->cr2 = 0;
+    tim1->smcr = 0;
+    tim1->ccer &= ~(TIM_CCER_CC1E | TIM_CCER_CC2E
+                    | TIM_CCER_CC1P | TIM_CCER_CC2P);
+    tim1->ccmr1 = (TIM_CCMR1_CC1S(TIM_CCS_INPUT_TI1)
+                   | TIM_CCMR1_CC2S(TIM_CCS_INPUT_TI2)); /* IC2 <- TI1 */
+    tim1->ccer |= (TIM_CCER_CC1E                    /* Rising edge */
+                   | TIM_CCER_CC2E | TIM_CCER_CC2P); /* Falling edge */
+    tim1->sr = 0;
+    tim1->cr1 = TIM_CR1_ARPE | TIM_CR1_CEN;
+    if (!sync_capture_active)
+        sync_start_valid = FALSE;
+    sync_capture_active = TRUE;
+}
+
+/* Return TIM1 to its OSD-box configuration. */
+static void sync_capture_stop(void)
+{
+    if (!sync_capture_active)
+        return;
+
+    tim1->cr1 = TIM_CR1_ARPE | TIM_CR1_OPM;
+    tim1->ccer &= ~TIM_CCER_CC2E;
+    tim1->ccmr1 = TIM_CCMR1_CC1S(TIM_CCS_INPUT_TI1);
+    tim1->cnt = 0;
+    tim1->sr = 0;
+    tim1->cr2 = TIM_CR2_MMS(2); /* UEV -> TRGO */
+    tim1->dier = TIM_DIER_CC3DE | TIM_DIER_CC4IE;
+
+    sync_capture_active = FALSE;
+    set_polarity();
+}
+
+void sync_frame_end(void)
+{
+    hline = HLINE_EOF;
+    sync_capture_start();
+    frame++;
+}
+
+struct autosync autosync;
+
+/* Line period: The interval between starts of sync, once two in a row 
+ * agree. Equalising and broad pulses are half a line apart: Such a run is 
+ * skipped, unless it is longer than any vblank (the line rate has doubled). 
+ * The period sampled at start of frame is then the last whole line before 
+ * vblank. */
+#define HALF_LINES_MAX 16
+static uint16_t line_period, prev_interval;
+static uint8_t half_lines;
+
+static bool_t interval_match(uint16_t d, uint16_t p)
+{
+    return (d > p - p/16) && (d < p + p/16);
+}
+
+static void line_period_sample(uint16_t d)
+{
+    if (interval_match(d, prev_interval)) {
+        if (interval_match(d, line_period/2) && (half_lines < HALF_LINES_MAX)) {
+            half_lines++;
+        } else {
+            line_period = d;
+            half_lines = 0;
+        }
+    }
+    prev_interval = d;
+}
+
+/* Interlace detection: Vertical sync starts on the line grid in one field, 
+ * and half a line off it in the other. The grid is given by the last sync 
+ * to start a whole line after its predecessor (equalising pulses are half a 
+ * line apart). The half-line field is the lower of the two: It scans out 
+ * the odd text lines of a field-interleaved OSD box. Video is interlaced 
+ * while the detected fields mostly alternate. */
+bool_t odd_field;
+uint8_t lace;
+static bool_t line_grid;
+static uint16_t line_sync_start; /* TIM1 timestamp on the line grid */
+
+/* Sync start at TIM1 timestamp @t, @d after the last: On the line grid? */
+static void line_grid_sample(uint16_t t, uint16_t d)
+{
+    unsigned int period = autosync.period;
+
+    if ((d > period - period/8) && (d < period + period/8)) {
+        line_sync_start = t;
+        line_grid = TRUE;
+    }
+}
+
+/* Vertical sync started at TIM1 timestamp @t. */
+static void field_detect(uint16_t t)
+{
+    unsigned int period = autosync.period, phase;
+    bool_t odd;
+
+    if (!period || !line_grid)
+        return;
+    line_grid = FALSE;
+
+    phase = (uint16_t)(t - line_sync_start) % period;
+    odd = (phase > period/4) && (phase < period - period/4);
+    if (odd != odd_field)
+        lace = min_t(uint8_t, lace+1, LACE_MAX);
+    else if (lace)
+        lace--;
+    odd_field = odd;
+}
+
+/* Hardware line counting: Rather than take a CSYNC/HSYNC IRQ on every line 
+ * between start of frame and the OSD box, we mask the EXTI line and clock 
+ * TIM1 from the sync input (TI1FP1, end-of-sync edge). TIM1 is otherwise 
+ * idle until the OSD box. A single update IRQ is raised on the line before 
+ * the box, where we hand back to IRQ_csync. It must be taken before the 
+ * next start of sync, else that line is missed: See 
+ * tests/line_count_model.c for the latency budget. */
+#define LINE_COUNT_MIN 4
+static bool_t line_count_hw = TRUE;
+static bool_t line_count_active;
+static unsigned int line_count_lines;
+
+/* Called at start of sync on the line after start of frame. The end of this 
+ * sync pulse is the first line counted. */
+static void line_count_start(void)
+{
+    unsigned int lines = vstart - HLINE_SOF - 1;
+
+    /* Box too close to start of frame? Count lines in IRQ_csync instead. */
+    if (!line_count_hw || (vstart <= HLINE_SOF) || (lines < LINE_COUNT_MIN))
+        return;
+
+    line_count_active = TRUE;
+    line_count_lines = lines;
+
+    /* Mask the sync IRQ: TIM1 counts lines from here. */
+    exti->imr &= ~m(pin_csync);
+
+    /* No OSD-box DMA or IRQ while counting lines. No TRGO on the overflow 
+     * UEV, else TIM2 and TIM4 would be triggered. */
+    tim1->dier = 0;
+    tim1->cr2 = 0;
+    tim1->cnt = 0x10000 - lines;
+    tim1->sr = 0;
+    tim1->dier = TIM_DIER_UIE;
+    tim1->smcr = (TIM_SMCR_TS(5) /* Filtered TI1 */
+                  | TIM_SMCR_SMS(7)); /* External Clock Mode 1 */
+    tim1->cr1 = (TIM_CR1_ARPE | TIM_CR1_OPM | TIM_CR1_URS | TIM_CR1_CEN);
+}
+
+/* Return TIM1 to its OSD-box configuration and unmask the sync IRQ. */
+void line_count_stop(void)
+{
+    if (!line_count_active)
+        return;
+
+    tim1->cr1 = TIM_CR1_ARPE | TIM_CR1_OPM;
+    tim1->smcr = 0;
+    tim1->dier = 0;
+    tim1->cnt = 0;
+    tim1->sr = 0;
+    tim1->cr2 = TIM_CR2_MMS(2); /* UEV -> TRGO */
+    tim1->dier = TIM_DIER_CC3DE | TIM_DIER_CC4IE;
+
+    exti->pr = m(pin_csync);
+    exti->imr |= m(pin_csync);
+
+    line_count_active = FALSE;
+}
+
+/* IRQ_line_count */
+void sync_line_count(void)
+{
+    if (line_count_active && (tim1->sr & TIM_SR_UIF)) {
+
+        line_count_stop();
+
+        /* We are at end of sync on the line before the OSD box. The next 
+         * sync IRQ brings us to @vstart. */
+        hline = HLINE_SOF + line_count_lines;
+
+    }
+}
+
+/* IRQ_vsync */
+void sync_vsync(void)
+{
+    exti->pr = m(pin_vsync);
+    line_count_stop();
+    tim1->smcr = 0;
+    if (sync_capture_active)
+        field_detect(tim1->cnt);
+    sync_capture_start();
+    hline = HLINE_VBL;
+}
+
+/* Sync polarity detection: Outside the frame, each sync edge votes for the 
+ * polarity under which the shorter of the last two pulses is the sync pulse 
+ * (Normal Sync ~= 5us, Porch+Data ~= 59us). Votes accumulate in a 
+ * saturating confidence counter (+ve: active high). A decision is made, or 
+ * flipped, when confidence reaches POL_DECIDE: A few tens of lines. The 
+ * broad pulses of vertical sync vote the wrong way, but too few of them to 
+ * overturn a saturated counter. */
+bool_t pol_decided;
+int8_t pol_conf;
+uint16_t pol_latency; /* votes taken by the last decision */
+static uint16_t pol_pending; /* votes since confidence was last decided */
+
+static void polarity_vote(bool_t high)
+{
+    int d;
+
+    pol_conf = high ? min_t(int8_t, pol_conf+1, POL_MAX)
+        : max_t(int8_t, pol_conf-1, -POL_MAX);
+    d = (pol_conf >= POL_DECIDE) ? SYNC_HIGH
+        : (pol_conf <= -POL_DECIDE) ? SYNC_LOW : -1;
+
+    if (pol_decided && (d == detected_polarity)) {
+        /* Confident in the current decision. */
+        pol_pending = 0;
+    } else if (d >= 0) {
+        /* New decision: Latency is in sync edges. */
+        detected_polarity = d;
+        pol_decided = TRUE;
+        pol_latency = pol_pending + 1;
+        pol_pending = 0;
+    } else {
+        pol_pending++;
+    }
+}
+
+static uint32_t sof_cycles;
+volatile uint32_t frame_cycles;
+
+/* IRQ_csync */
+bool_t sync_csync(void)
+{
+    exti->pr = m(pin_csync);
+
+    if (hline == HLINE_SOF) {
+        /* Start of sync on the second line: Hand TIM1 back for line 
+         * counting and the OSD box. */
+        sync_capture_stop();
+        line_count_start();
+    }
+
+    if (hline <= 0) { /* EOF or VBL */
+
+        static uint16_t prev_w;
+        uint16_t rise = tim1->ccr1, fall = tim1->ccr2, w;
+        bool_t csync_now = gpio_read_pin(gpio_csync, pin_csync);
+
+        /* Trigger on both sync edges so we can measure sync pulse width: 
+         * Normal Sync ~= 5us, Porch+Data ~= 59us */
+        exti->ftsr |= m(pin_csync) | m(pin_vsync);
+        exti->rtsr |= m(pin_csync) | m(pin_vsync);
+
+        /* Width of the pulse which just ended, from TIM1 edge timestamps. 
+         * If it's high now, it was a low pulse. */
+        w = csync_now ? rise - fall : fall - rise;
+
+        /* A low pulse shorter than the high pulse before it is a sync 
+         * pulse of an active-low signal, and vice versa. */
+        polarity_vote(csync_now ? (w >= prev_w) : (w < prev_w));
+        prev_w = w;
+
+        if (csync_now == running_polarity) {
+
+            /* Sync pulse start: remember when. */
+            uint16_t t = csync_now ? rise : fall, d = t - sync_start;
+            if (sync_start_valid) {
+                line_period_sample(d);
+                line_grid_sample(t, d);
+            }
+            sync_start = t;
+            sync_start_valid = TRUE;
+
+        } else if (w > sysclk_us(10)) {
+
+            /* Long sync: We are in vblank. The first one starts vertical 
+             * sync. */
+            if (hline != HLINE_VBL)
+                field_detect(sync_start);
+            hline = HLINE_VBL;
+
+        } else if (hline == HLINE_VBL) {
+
+            /* Short sync: We are outside the vblank period. Start frame (we 
+             * were previously in vblank), and log the line period. TIM1 
+             * keeps timestamping until the next sync. */
+            hline = HLINE_SOF;
+            if (line_period)
+                autosync_sample(&autosync, line_period);
+            frame_cycles = dwt->cyccnt - sof_cycles;
+            sof_cycles += frame_cycles;
+            slave_arr_update();
+            set_polarity();
+
+        }
+
+        return FALSE;
+
+    }
+
+    /* Before vertical start of OSD, we get here only if the OSD box is too 
+     * close to start of frame for line_count. */
+    return (++hline >= vstart);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -39,6 +39,17 @@ void *memmove(void *dest, const void *src, size_t n)
     return dest;
 }
 
+int memcmp(const void *s1, const void *s2, size_t n)
+{
+    const unsigned char *p = s1, *q = s2;
+    while (n--) {
+        int diff = *p++ - *q++;
+        if (diff)
+            return diff;
+    }
+    return 0;
+}
+
 size_t strlen(const char *s)
 {
     size_t len = 0;
@@ -0,0 +1,345 @@
+/*
+ * autosync_replay.c
+ *
+ * Line-period estimator: Replay sync-period sequences (one sample per
+ * frame) through autosync_sample(), and measure time-to-lock.
+ *
+ *  autosync_replay            Run the built-in scenarios
+ *  autosync_replay <trace>... Replay traces: One period (SYSCLK ticks) per
+ *                             line, in decimal
+ *
+ * Built-in scenarios switch between line rates with a torn sample at each
+ * switch, and add jitter and isolated glitches. Each new rate must be
+ * locked within two frames of its first clean sample, with no other
+ * (re)locks.
+ *
+ * Sync scenarios instead feed sync edge streams through the firmware's
+ * sync state machine (sync_model.c), which takes the samples. Each signal
+ * must be detected as its own video timing within a few frames, and never
+ * as another.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdio.h>
+#include "sync_model.c"
+
+#define SYSCLK_HZ 72000000u
+#define PAL   (SYSCLK_HZ / 15625)   /* 4608 */
+#define NTSC  (SYSCLK_HZ / 15734)   /* 4576 */
+#define K24   (SYSCLK_HZ / 24500)   /* 2938 */
+#define VGA   (SYSCLK_HZ / 31469)   /* 2287 */
+
+#define MAX_LOCK_FRAMES 2
+
+static unsigned int failures;
+
+static uint32_t rnd_state = 1;
+static uint32_t rnd(void)
+{
+    /* xorshift32 */
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+/* A scenario: Samples, and the period each should lock to (0 for a glitch
+ * or torn sample). */
+#define MAX_SAMPLES 4096
+static uint16_t sample[MAX_SAMPLES], expect[MAX_SAMPLES];
+static unsigned int nr_samples;
+
+struct segment {
+    uint16_t period;
+    uint16_t frames;
+    uint8_t jitter;       /* +/- ticks */
+    uint8_t glitch_every; /* frames between isolated glitches (0: none) */
+};
+
+static void add(uint16_t s, uint16_t e)
+{
+    if (nr_samples < MAX_SAMPLES) {
+        sample[nr_samples] = s;
+        expect[nr_samples] = e;
+        nr_samples++;
+    }
+}
+
+/* Any value, away from @p and @q: A torn or noisy measurement. (A sample
+ * close to the old rate may relock within that rate, which is harmless.) */
+static bool_t near(uint16_t g, uint16_t p)
+{
+    return (g > p - 4*AUTOSYNC_TOL) && (g < p + 4*AUTOSYNC_TOL);
+}
+
+static uint16_t glitch(uint16_t p, uint16_t q)
+{
+    uint16_t g;
+    do {
+        g = 1000 + rnd() % 6000;
+    } while (near(g, p) || near(g, q));
+    return g;
+}
+
+static void generate(const struct segment *seg, unsigned int nr)
+{
+    unsigned int i, f;
+    int j;
+
+    nr_samples = 0;
+    for (i = 0; i < nr; i++) {
+        /* A mode switch tears the sample which spans it. */
+        if (i != 0)
+            add(glitch(seg[i].period, seg[i-1].period), 0);
+        for (f = 0; f < seg[i].frames; f++) {
+            if (seg[i].glitch_every && f && !(f % seg[i].glitch_every)) {
+                add(glitch(seg[i].period, seg[i].period), 0);
+                continue;
+            }
+            j = seg[i].jitter
+                ? (int)(rnd() % (2*seg[i].jitter+1)) - seg[i].jitter : 0;
+            add(seg[i].period + j, seg[i].period);
+        }
+    }
+}
+
+static uint16_t diff(uint16_t a, uint16_t b)
+{
+    return (a > b) ? a - b : b - a;
+}
+
+static bool_t quiet;
+
+/* Replay the generated scenario and check each lock. */
+static void replay_scenario(const char *name, unsigned int nr_segs)
+{
+    struct autosync a;
+    unsigned int i, start = 0, worst = 0, stray = 0;
+    uint16_t want = 0;
+    bool_t locked = FALSE;
+
+    memset(&a, 0, sizeof(a));
+
+    for (i = 0; i < nr_samples; i++) {
+        autosync_sample(&a, sample[i]);
+
+        /* First clean sample of a new rate? */
+        if (expect[i] && (expect[i] != want)) {
+            want = expect[i];
+            start = i;
+            locked = FALSE;
+        }
+        if (!want)
+            continue;
+
+        if (!locked && (diff(a.period, want) <= AUTOSYNC_TOL)) {
+            locked = TRUE;
+            worst = max_t(unsigned int, worst, i - start + 1);
+        } else if (locked && (diff(a.period, want) > AUTOSYNC_TOL)) {
+            /* Lost lock on a stable rate. */
+            stray++;
+            locked = FALSE;
+        } else if (!locked && (i - start + 1 > MAX_LOCK_FRAMES)) {
+            printf("FAIL %s: no lock to %u within %u frames (sample %u, "
+                   "period %u)\n", name, want, MAX_LOCK_FRAMES, i, a.period);
+            failures++;
+            return;
+        }
+    }
+
+    if (stray || (a.locks != nr_segs)) {
+        printf("FAIL %s: %u locks for %u rates, %u lost locks\n",
+               name, a.locks, nr_segs, stray);
+        for (i = 0; i < nr_samples; i++)
+            printf("%u%c", sample[i], ((i & 15) == 15) ? '\n' : ' ');
+        printf("\n");
+        failures++;
+        return;
+    }
+
+    if (!quiet)
+        printf("PASS %s: %u samples, %u locks, worst time-to-lock %u "
+               "frames\n", name, nr_samples, a.locks, worst);
+}
+
+#define SCENARIO(name, segs...) do {                            \
+    const struct segment s[] = { segs };                        \
+    generate(s, ARRAY_SIZE(s));                                 \
+    replay_scenario(name, ARRAY_SIZE(s));                       \
+} while (0)
+
+static void scenarios(void)
+{
+    unsigned int n;
+
+    SCENARIO("PAL from power-on", { PAL, 100, 0, 0 });
+    SCENARIO("NTSC with jitter", { NTSC, 2000, 6, 0 });
+    SCENARIO("PAL with glitches", { PAL, 2000, 2, 7 });
+    SCENARIO("PAL/NTSC switches",
+             { PAL, 50, 2, 0 }, { NTSC, 50, 2, 0 }, { PAL, 50, 2, 0 });
+    SCENARIO("Amiga PAL/productivity switches",
+             { PAL, 100, 2, 0 }, { VGA, 100, 2, 0 }, { PAL, 100, 2, 0 },
+             { VGA, 100, 2, 0 });
+    SCENARIO("24kHz/VGA switches with glitches",
+             { K24, 100, 3, 9 }, { VGA, 100, 3, 9 }, { K24, 100, 3, 9 });
+
+    /* The torn sample at a switch can land anywhere: Try many. */
+    quiet = TRUE;
+    for (n = 0; n < 10000; n++) {
+        const struct segment s[] = {
+            { PAL, 5, 2, 0 }, { VGA, 5, 2, 0 }, { NTSC, 5, 2, 0 },
+            { K24, 5, 2, 0 }, { PAL, 5, 2, 0 } };
+        generate(s, ARRAY_SIZE(s));
+        replay_scenario("random torn samples", ARRAY_SIZE(s));
+        if (failures)
+            return;
+    }
+    quiet = FALSE;
+    printf("PASS random torn samples: %u sequences\n", n);
+}
+
+/* Sync scenarios: The video timing detected at each start of frame, as by 
+ * do_autosync(). */
+#define SYNC_LOCK_FRAMES 4
+static unsigned int sync_frames, sync_lock, sync_stray;
+static int sync_want;
+
+static void model_event(int ev)
+{
+    unsigned int period = autosync.period, lines, timing;
+
+    if (ev != EV_SOF)
+        return;
+    sync_frames++;
+    if (!period)
+        return;
+
+    lines = (frame_cycles + period/2) / period;
+    timing = timing_detect(period, lines);
+    running_display_timing = timing;
+    if (timing == sync_want) {
+        if (!sync_lock)
+            sync_lock = sync_frames;
+    } else if (sync_lock) {
+        sync_stray++;
+    }
+}
+
+struct sync_segment {
+    struct signal sig;
+    int timing;
+    unsigned int frames;
+};
+
+static void sync_scenario(const char *name, const struct sync_segment *seg,
+                          unsigned int nr)
+{
+    unsigned int i, f, worst = 0;
+
+    model_reset();
+    vstart = 30;
+    height = 20;
+
+    for (i = 0; i < nr; i++) {
+        sync_want = seg[i].timing;
+        sync_frames = sync_lock = sync_stray = 0;
+        for (f = 0; f < seg[i].frames; f++)
+            seg[i].sig.field(&seg[i].sig, f);
+        if (!sync_lock || (sync_lock > SYNC_LOCK_FRAMES) || sync_stray) {
+            printf("FAIL %s: %s: %s after %u frames (locked at frame %u, "
+                   "%u stray frames), period %u\n", name, seg[i].sig.name,
+                   video_timings[running_display_timing].name, sync_frames,
+                   sync_lock, sync_stray, autosync.period);
+            failures++;
+            return;
+        }
+        worst = max_t(unsigned int, worst, sync_lock);
+    }
+
+    printf("PASS %s: worst time-to-detect %u frames\n", name, worst);
+}
+
+#define PAL_CSYNC { "PAL csync", csync_field, LINE_PAL, 312, 5 }
+#define PAL_LACE { "PAL csync, interlaced", csync_field, LINE_PAL, 312, 5, \
+                   TRUE }
+#define NTSC_CSYNC { "NTSC csync", csync_field, LINE_NTSC, 262, 6 }
+#define NTSC_LACE { "NTSC csync, interlaced", csync_field, LINE_NTSC, 262, \
+                    6, TRUE }
+#define VGA_HVSYNC { "VGA hsync+vsync", hvsync_field, LINE_VGA, 525 }
+
+#define SYNC_SCENARIO(name, segs...) do {                       \
+    const struct sync_segment s[] = { segs };                   \
+    sync_scenario(name, s, ARRAY_SIZE(s));                      \
+} while (0)
+
+static void sync_scenarios(void)
+{
+    SYNC_SCENARIO("PAL composite", { PAL_CSYNC, TIMING_PAL, 100 });
+    SYNC_SCENARIO("PAL composite, interlaced",
+                  { PAL_LACE, TIMING_PAL, 100 });
+    SYNC_SCENARIO("NTSC composite", { NTSC_CSYNC, TIMING_NTSC, 100 });
+    SYNC_SCENARIO("NTSC composite, interlaced",
+                  { NTSC_LACE, TIMING_NTSC, 100 });
+    SYNC_SCENARIO("Amiga PAL/productivity switches",
+                  { PAL_CSYNC, TIMING_PAL, 50 },
+                  { VGA_HVSYNC, TIMING_VGA60, 50 },
+                  { PAL_LACE, TIMING_PAL, 50 },
+                  { NTSC_CSYNC, TIMING_NTSC, 50 });
+}
+
+/* Replay a recorded trace, and report each (re)lock. */
+static void replay_trace(const char *name)
+{
+    struct autosync a;
+    unsigned int p, i = 0, locks = 0;
+    FILE *f = fopen(name, "r");
+
+    if (!f) {
+        printf("%s: cannot open\n", name);
+        failures++;
+        return;
+    }
+
+    memset(&a, 0, sizeof(a));
+    while (fscanf(f, "%u", &p) == 1) {
+        autosync_sample(&a, p);
+        i++;
+        if (a.locks == locks)
+            continue;
+        locks = a.locks;
+        printf("%s: sample %u: lock to %u ticks (%u Hz) in %u frames\n",
+               name, i, a.period, SYSCLK_HZ / a.period, a.latency);
+    }
+    fclose(f);
+
+    printf("%s: %u samples, %u locks\n", name, i, a.locks);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    if (argc > 1) {
+        for (i = 1; i < argc; i++)
+            replay_trace(argv[i]);
+        return failures ? 1 : 0;
+    }
+
+    scenarios();
+    sync_scenarios();
+
+    printf("autosync_replay: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,25 @@
+/*
+ * bench.h
+ * 
+ * Host timing for benchmarks (bench.c). Standalone: bench.c is built 
+ * without the firmware headers, as the host's <time.h> clashes with them.
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Monotonic time in nanoseconds. */
+uint64_t host_ns(void);
+
+/* CPU cycle counter (TSC on x86), else nanoseconds. */
+uint64_t host_cycles(void);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,46 @@
+/*
+ * host.h
+ * 
+ * Build firmware sources on the host, for tests and benchmarks. Included 
+ * after decls.h: Replaces the ARM-only intrinsics. Peripheral register 
+ * accesses still compile, but must not be executed.
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#undef illegal
+#define illegal() __builtin_trap();
+
+#undef cpu_sync
+#define cpu_sync() barrier()
+#undef cpu_relax
+#define cpu_relax() barrier()
+#undef cpu_wfi
+#define cpu_wfi() barrier()
+
+#undef global_disable_exceptions
+#define global_disable_exceptions() barrier()
+#undef global_enable_exceptions
+#define global_enable_exceptions() barrier()
+#undef IRQ_global_disable
+#define IRQ_global_disable() barrier()
+#undef IRQ_global_enable
+#define IRQ_global_enable() barrier()
+
+#undef read_special
+#define read_special(reg) 0u
+#undef write_special
+#define write_special(reg,val) ((void)(val))
+
+#include "bench.h"
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,108 @@
+/*
+ * interlace_test.c
+ *
+ * Drive the sync state machine (src/sync.c) with synthetic composite sync,
+ * through the peripheral model in sync_model.c, and check field detection.
+ *
+ * In an interlaced signal the fields are a half line apart: Vertical sync
+ * starts a whole number of lines after the line grid in one field, and
+ * a whole number and a half in the next. Once the line period is locked,
+ * every field must be detected with the parity the generator gave it, and
+ * the signal must be reported interlaced. A progressive signal must never
+ * be reported interlaced.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdio.h>
+#include "sync_model.c"
+
+#define FIELDS 50
+#define LOCK_FIELDS 10 /* period lock, then interlace detection */
+
+static unsigned int failures;
+
+/* Field being generated, and whether its start was seen. */
+static unsigned int field;
+static bool_t field_sof;
+
+static void model_event(int ev)
+{
+    if (ev == EV_SOF)
+        field_sof = TRUE;
+}
+
+/* Parity of field @n: Half lines from the line grid to vertical sync. The
+ * last sync on the grid is that of the last whole line of the previous
+ * field, or the pre-equalising pulse a whole line after it. */
+static bool_t expected_odd(const struct signal *sig, unsigned int n)
+{
+    unsigned int a, b;
+
+    csync_gaps(sig, n-1, &a, &b);
+    return ((b == 2) ? sig->eq : sig->eq + 1) & 1;
+}
+
+static void test_fields(const struct signal *sig)
+{
+    unsigned int bad = 0, odd = 0, lace_fields = 0;
+
+    model_reset();
+    vstart = 30;
+    height = 20;
+
+    for (field = 0; field < FIELDS; field++) {
+        field_sof = FALSE;
+        sig->field(sig, field);
+        if (field < LOCK_FIELDS)
+            continue;
+        if (!field_sof || (odd_field != expected_odd(sig, field))) {
+            if (!bad)
+                printf(" %s: field %u: %s, expected %s\n", sig->name, field,
+                       !field_sof ? "no start of frame"
+                       : odd_field ? "odd" : "even",
+                       expected_odd(sig, field) ? "odd" : "even");
+            bad++;
+        }
+        odd += odd_field;
+        lace_fields += interlaced();
+    }
+
+    if (lace_fields != (sig->interlaced ? FIELDS - LOCK_FIELDS : 0))
+        bad++;
+
+    printf("%s %s: %u odd fields of %u, interlaced %u, %u bad\n",
+           bad ? "FAIL" : "PASS", sig->name, odd, FIELDS - LOCK_FIELDS,
+           lace_fields, bad);
+    if (bad)
+        failures++;
+}
+
+static const struct signal signals[] = {
+    { "PAL csync", csync_field, LINE_PAL, 312, 5 },
+    { "PAL csync, interlaced", csync_field, LINE_PAL, 312, 5, TRUE },
+    { "NTSC csync", csync_field, LINE_NTSC, 262, 6 },
+    { "NTSC csync, interlaced", csync_field, LINE_NTSC, 262, 6, TRUE },
+};
+
+int main(int argc, char **argv)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(signals); i++)
+        test_fields(&signals[i]);
+
+    printf("interlace_test: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
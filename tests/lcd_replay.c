@@ -0,0 +1,325 @@
+/*
+ * lcd_replay.c
+ *
+ * HD44780 emulation: Replay PCF8574 traffic through lcd_process(). Checks
+ * the decoded display for the usual 4-bit host write patterns, and reports
+ * decode throughput against the I2C line rate.
+ *
+ *  lcd_replay               Check decode of generated 4x20 traffic
+ *  lcd_replay bench         Also report bytes/s and cycles/byte
+ *  lcd_replay <capture>...  Replay raw captures of PCF8574 writes (one byte
+ *                           per write) and report throughput
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdio.h>
+#include "../src/i2c.c"
+
+/* 400kHz I2C: Nine bit times per byte. */
+#define I2C_BYTES_PER_SEC (400000 / 9)
+
+static unsigned int failures;
+
+static uint32_t rnd_state = 1;
+static uint32_t rnd(void)
+{
+    /* xorshift32 */
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+/* Generated host traffic. */
+static uint8_t traffic[16384];
+static unsigned int traffic_len;
+
+/* Host write patterns for one nibble: EN high then EN low (as FlashFloppy),
+ * or EN low, high, low (as the Arduino LiquidCrystal_I2C library). Some
+ * hosts also poll the busy flag, with RW high, after each byte. */
+static bool_t en_before, busy_poll;
+
+static void put(uint8_t x)
+{
+    traffic[traffic_len++] = x;
+}
+
+static void nibble(uint8_t n, bool_t rs)
+{
+    uint8_t x = (n << 4) | _BL | (rs ? _RS : 0);
+    if (en_before)
+        put(x);
+    put(x | _EN);
+    put(x);
+}
+
+static void lcd_byte(uint8_t b, bool_t rs)
+{
+    unsigned int i;
+
+    nibble(b >> 4, rs);
+    nibble(b & 15, rs);
+    if (!busy_poll)
+        return;
+    for (i = 0; i < 2; i++) {
+        put(0xf0 | _BL | _RW);
+        put(0xf0 | _BL | _RW | _EN);
+        put(0xf0 | _BL | _RW);
+    }
+}
+
+static void lcd_cmd(uint8_t c)
+{
+    lcd_byte(c, FALSE);
+}
+
+/* 4-bit mode init: Three 8-bit Function Sets, then switch to 4-bit. */
+static void gen_init(void)
+{
+    nibble(3, FALSE);
+    nibble(3, FALSE);
+    nibble(3, FALSE);
+    nibble(2, FALSE);
+    lcd_cmd(0x28); /* Function Set: 4-bit, 2 lines */
+    lcd_cmd(0x0c); /* Display On */
+    lcd_cmd(0x06); /* Entry Mode: Increment */
+    lcd_cmd(0x01); /* Clear Display */
+}
+
+/* Full refresh of a 4x20 display: Each row is addressed, then written. */
+static const uint8_t row_addr[] = { 0x00, 0x40, 0x14, 0x54 };
+static uint8_t screen[4][20];
+
+static void gen_refresh(void)
+{
+    unsigned int y, x;
+
+    for (y = 0; y < 4; y++) {
+        lcd_cmd(0x80 | row_addr[y]);
+        for (x = 0; x < 20; x++)
+            lcd_byte(screen[y][x], TRUE);
+    }
+}
+
+static void new_screen(void)
+{
+    unsigned int y, x;
+
+    for (y = 0; y < 4; y++)
+        for (x = 0; x < 20; x++)
+            screen[y][x] = 0x20 + rnd() % 0x5f;
+}
+
+static void lcd_reset(void)
+{
+    memset(&i2c_display, 0, sizeof(i2c_display));
+    i2c_display.rows = 4;
+    config.max_cols = 40;
+    lcd_inc = FALSE;
+    lcd_ddraddr = 0;
+    lcd_cgram = FALSE;
+    lcd_cgaddr = 0;
+}
+
+/* Feed @p in randomly-sized spans, as from the data ring. */
+static void feed(const uint8_t *p, unsigned int n)
+{
+    unsigned int span;
+
+    while (n) {
+        span = min_t(unsigned int, n, 1 + rnd() % 64);
+        lcd_process(p, span);
+        p += span;
+        n -= span;
+    }
+}
+
+static void check_screen(const char *name)
+{
+    unsigned int y, x;
+
+    if (i2c_display.cols != 20) {
+        printf("FAIL %s: %d columns\n", name, i2c_display.cols);
+        failures++;
+        return;
+    }
+    for (y = 0; y < 4; y++) {
+        for (x = 0; x < 20; x++) {
+            if (i2c_display.text[y][x] == screen[y][x])
+                continue;
+            printf("FAIL %s: row %u col %u is %02x, expected %02x\n", name,
+                   y, x, i2c_display.text[y][x], screen[y][x]);
+            failures++;
+            return;
+        }
+    }
+    if (!i2c_display.on) {
+        printf("FAIL %s: backlight off\n", name);
+        failures++;
+        return;
+    }
+    printf("PASS %s\n", name);
+}
+
+static void test_refresh(bool_t _en_before, bool_t _busy_poll,
+                         const char *name)
+{
+    unsigned int i;
+
+    en_before = _en_before;
+    busy_poll = _busy_poll;
+    lcd_reset();
+    traffic_len = 0;
+    gen_init();
+    feed(traffic, traffic_len);
+    for (i = 0; i < 50; i++) {
+        new_screen();
+        traffic_len = 0;
+        gen_refresh();
+        feed(traffic, traffic_len);
+    }
+    busy_poll = FALSE;
+    check_screen(name);
+}
+
+/* CGRAM: Eight glyphs written in one go, then shown at codes 0-7. */
+static void test_cgram(void)
+{
+    uint16_t line[LINE_WORDS];
+    unsigned int g, y;
+
+    en_before = FALSE;
+    lcd_reset();
+    traffic_len = 0;
+    gen_init();
+    lcd_cmd(0x40);
+    for (g = 0; g < 8; g++)
+        for (y = 0; y < 8; y++)
+            lcd_byte(g ^ (y << 2), TRUE);
+    lcd_cmd(0x80);
+    for (g = 0; g < 8; g++)
+        lcd_byte(g, TRUE);
+    feed(traffic, traffic_len);
+
+    for (y = 0; y < 8; y++) {
+        render_line(line, 2 + y, &i2c_display);
+        for (g = 0; g < 8; g++) {
+            uint8_t want = ((g ^ (y << 2)) & 0x1f) << 2;
+            uint8_t got = line[g/2] >> ((g & 1) ? 0 : 8);
+            if (got == want)
+                continue;
+            printf("FAIL cgram: glyph %u line %u is %02x, expected %02x\n",
+                   g, y, got, want);
+            failures++;
+            return;
+        }
+    }
+    printf("PASS cgram\n");
+}
+
+/* Decode @n bytes of traffic repeatedly in ring-sized spans, and report
+ * against the 400kHz line rate. */
+static void throughput(const char *name, const uint8_t *p, unsigned int n)
+{
+    const unsigned int target = 1u << 27;
+    unsigned int done, i, span;
+    uint64_t t, c;
+    double bps, cpb;
+
+    t = host_ns();
+    c = host_cycles();
+    for (done = 0; done < target; done += n) {
+        for (i = 0; i < n; i += span) {
+            span = min_t(unsigned int, n - i, 256);
+            lcd_process(p + i, span);
+        }
+    }
+    c = host_cycles() - c;
+    t = host_ns() - t;
+
+    bps = (double)done * 1e9 / t;
+    cpb = (double)c / done;
+    printf("%s: %u bytes: %.1f Mbytes/s, %.2f cycles/byte, "
+           "%.0fx the 400kHz line rate\n", name, n, bps / 1e6, cpb,
+           bps / I2C_BYTES_PER_SEC);
+}
+
+static void bench(void)
+{
+    printf("Decode budget at 400kHz on a 72MHz STM32: %u cycles/byte\n",
+           72000000 / I2C_BYTES_PER_SEC);
+
+    en_before = FALSE;
+    lcd_reset();
+    new_screen();
+    traffic_len = 0;
+    gen_refresh();
+    printf("4x20 refresh, EN high/low: %u bytes, %.2f ms at 400kHz\n",
+           traffic_len, traffic_len * 1e3 / I2C_BYTES_PER_SEC);
+    throughput("lcd bench, EN high/low", traffic, traffic_len);
+
+    en_before = TRUE;
+    traffic_len = 0;
+    gen_refresh();
+    printf("4x20 refresh, EN low/high/low: %u bytes, %.2f ms at 400kHz\n",
+           traffic_len, traffic_len * 1e3 / I2C_BYTES_PER_SEC);
+    throughput("lcd bench, EN low/high/low", traffic, traffic_len);
+}
+
+static void replay(const char *name)
+{
+    FILE *f = fopen(name, "rb");
+    unsigned int y;
+
+    if (!f) {
+        printf("%s: cannot open\n", name);
+        failures++;
+        return;
+    }
+    traffic_len = fread(traffic, 1, sizeof(traffic), f);
+    fclose(f);
+
+    lcd_reset();
+    feed(traffic, traffic_len);
+    printf("%s: %d rows, %d cols, backlight %s\n", name, i2c_display.rows,
+           i2c_display.cols, i2c_display.on ? "on" : "off");
+    for (y = 0; y < i2c_display.rows; y++)
+        printf(" |%.*s|\n", i2c_display.cols, i2c_display.text[y]);
+    if (traffic_len)
+        throughput(name, traffic, traffic_len);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    font_init();
+
+    if ((argc > 1) && strcmp(argv[1], "bench")) {
+        for (i = 1; i < argc; i++)
+            replay(argv[i]);
+        return failures ? 1 : 0;
+    }
+
+    test_refresh(FALSE, FALSE, "4x20 refresh, EN high/low");
+    test_refresh(TRUE, FALSE, "4x20 refresh, EN low/high/low");
+    test_refresh(FALSE, TRUE, "4x20 refresh, busy-flag polls");
+    test_cgram();
+    if (argc > 1)
+        bench();
+
+    printf("lcd_replay: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
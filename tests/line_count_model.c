@@ -0,0 +1,231 @@
+/*
+ * line_count_model.c
+ *
+ * Drive the sync state machine (src/sync.c) with synthetic CSYNC (or
+ * HSYNC+VSYNC) edge streams, through the peripheral model in sync_model.c.
+ *
+ * For every vertical offset, the OSD box must start and end on the same
+ * sync edge with hardware line counting as with line counting in IRQ_csync.
+ * The model also counts sync IRQs per frame, and finds the IRQ_line_count
+ * latency budget.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdio.h>
+#include "sync_model.c"
+
+static unsigned int failures;
+
+/* Per-frame record: Sync edges (by index) at which the box starts and the
+ * frame ends, and IRQs taken up to start of frame. */
+struct frame {
+    uint64_t box_edge, eof_edge;
+    unsigned int csync_irqs, lc_irqs;
+};
+#define FRAMES 6
+static struct frame frames[FRAMES], *cur;
+static unsigned int nr_frames;
+
+static void model_event(int ev)
+{
+    switch (ev) {
+    case EV_SOF:
+        cur = (nr_frames < FRAMES) ? &frames[nr_frames++] : NULL;
+        if (cur) {
+            memset(cur, 0, sizeof(*cur));
+            cur->csync_irqs = csync_irqs;
+            cur->lc_irqs = lc_irqs;
+        }
+        break;
+    case EV_BOX:
+        if (cur)
+            cur->box_edge = edge_idx;
+        break;
+    case EV_EOF:
+        if (cur)
+            cur->eof_edge = edge_idx;
+        break;
+    }
+}
+
+static const struct signal signals[] = {
+    { "PAL csync", csync_field, LINE_PAL, 312, 5 },
+    { "NTSC csync", csync_field, LINE_NTSC, 262, 6 },
+    { "PAL hsync+vsync", hvsync_field, LINE_PAL, 312 },
+};
+
+/* Run @sig with the box at @_vstart, @_height lines. Returns frames
+ * recorded. */
+static unsigned int run(const struct signal *sig, unsigned int _vstart,
+                        unsigned int _height)
+{
+    unsigned int i;
+
+    model_reset();
+    vstart = _vstart;
+    height = _height;
+    memset(frames, 0, sizeof(frames));
+    nr_frames = 0;
+    cur = NULL;
+
+    for (i = 0; i < FRAMES + 1; i++)
+        sig->field(sig, i);
+
+    return nr_frames;
+}
+
+/* Compare hardware line counting with counting in IRQ_csync, over box
+ * positions @vmin to @vmax-1. Returns the number of mismatching positions. */
+static unsigned int compare(const struct signal *sig, unsigned int vmin,
+                            unsigned int vmax, bool_t verbose)
+{
+    struct frame ref[FRAMES];
+    unsigned int v, h, n, i, bad = 0;
+    const unsigned int heights[] = { 1, 8, 60 };
+
+    for (h = 0; h < ARRAY_SIZE(heights); h++) {
+        for (v = vmin; v < vmax; v++) {
+            line_count_hw = FALSE;
+            n = run(sig, v, heights[h]);
+            memcpy(ref, frames, sizeof(ref));
+            line_count_hw = TRUE;
+            if (run(sig, v, heights[h]) != n) {
+                bad++;
+                continue;
+            }
+            for (i = 0; i < n; i++) {
+                if ((frames[i].box_edge == ref[i].box_edge)
+                    && (frames[i].eof_edge == ref[i].eof_edge))
+                    continue;
+                if (verbose && !bad)
+                    printf(" %s: vstart %u height %u frame %u: box edge "
+                           "%llu, expected %llu\n", sig->name, v,
+                           heights[h], i,
+                           (unsigned long long)frames[i].box_edge,
+                           (unsigned long long)ref[i].box_edge);
+                bad++;
+                break;
+            }
+        }
+    }
+
+    return bad;
+}
+
+/* A box below the bottom of the frame is counted into the next vblank,
+ * where the shortest gap from end of sync to the next start of sync is
+ * after a broad pulse. All positions must work within that latency. */
+static void test_equivalence(void)
+{
+    unsigned int i, bad;
+    const uint32_t latency[] = {
+        0, sysclk_us(2), LINE_PAL/2 - BROAD - sysclk_ns(500) };
+
+    for (i = 0; i < ARRAY_SIZE(signals) * ARRAY_SIZE(latency); i++) {
+        const struct signal *sig = &signals[i % ARRAY_SIZE(signals)];
+        param.lc_latency = latency[i / ARRAY_SIZE(signals)];
+        bad = compare(sig, 0, sig->lines + 20, TRUE);
+        printf("%s %s, IRQ_line_count latency %.1fus: %u box positions "
+               "differ\n", bad ? "FAIL" : "PASS", sig->name,
+               (double)param.lc_latency / SYSCLK_MHZ, bad);
+        if (bad)
+            failures++;
+    }
+    param.lc_latency = 0;
+}
+
+/* The model must see the faults that the firmware guards against. */
+static void test_mutations(void)
+{
+    const struct signal *sig = &signals[0];
+    unsigned int bad;
+
+    param.lc_keeps_pr = TRUE;
+    bad = compare(sig, 0, sig->lines + 20, FALSE);
+    param.lc_keeps_pr = FALSE;
+    printf("%s stale EXTI pending bit detected (%u box positions)\n",
+           bad ? "PASS" : "FAIL", bad);
+    if (!bad)
+        failures++;
+}
+
+/* IRQ_line_count must run before the next start of sync, else that line is
+ * missed. Find the latency budget for boxes at @vmin-@vmax by bisection:
+ * It must be the gap from end of sync to the next start of sync (@gap)
+ * on the last line counted. */
+static void budget(const char *what, unsigned int vmin, unsigned int vmax,
+                   uint32_t gap)
+{
+    const struct signal *sig = &signals[0];
+    uint32_t lo = 0, hi = LINE_PAL, mid;
+
+    while (hi - lo > 4) {
+        param.lc_latency = (lo + hi) / 2;
+        if (compare(sig, vmin, vmax, FALSE))
+            hi = param.lc_latency;
+        else
+            lo = param.lc_latency;
+    }
+    param.lc_latency = 0;
+
+    mid = (lo + hi) / 2;
+    printf("%s IRQ_line_count latency budget, %s: %.1fus\n",
+           ((lo < gap) && (gap <= hi)) ? "PASS" : "FAIL", what,
+           (double)mid / SYSCLK_MHZ);
+    if (!((lo < gap) && (gap <= hi)))
+        failures++;
+}
+
+/* Sync IRQs in frame @i. */
+static unsigned int irqs(unsigned int i)
+{
+    return (frames[i+1].csync_irqs + frames[i+1].lc_irqs
+            - frames[i].csync_irqs - frames[i].lc_irqs);
+}
+
+/* Sync IRQs per frame, with and without hardware line counting. */
+static void report_irqs(void)
+{
+    const unsigned int v[] = { 6, 30, 100, 200 };
+    unsigned int i, sw, hw_irqs;
+
+    for (i = 0; i < ARRAY_SIZE(v); i++) {
+        line_count_hw = FALSE;
+        run(&signals[0], v[i], 60);
+        sw = irqs(2);
+        line_count_hw = TRUE;
+        run(&signals[0], v[i], 60);
+        hw_irqs = irqs(2);
+        printf("PAL csync, vstart %3u, 60-line box: %3u sync IRQs/frame, "
+               "%3u with line counting\n", v[i], sw, hw_irqs);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    test_equivalence();
+    test_mutations();
+    /* First line counted is an equalising pulse when vstart is small. */
+    budget("box within frame", LINE_COUNT_MIN + 3, signals[0].lines - 8,
+           LINE_PAL - SYNC);
+    budget("box from vstart 6", LINE_COUNT_MIN + 2,
+           signals[0].lines - 8, LINE_PAL/2 - EQ);
+    budget("box below frame", 0, signals[0].lines + 20,
+           LINE_PAL/2 - BROAD);
+    report_irqs();
+
+    printf("line_count_model: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,462 @@
+/*
+ * oled_test.c
+ *
+ * SSD1306 emulation: Feed SSD1306 I2C byte streams through oled_process()
+ * and oled_flush(), and compare the resulting bitmap against golden images.
+ *
+ * Streams are generated from the golden images by an independent encoder
+ * (GDDRAM layout as per the SSD1306 datasheet), wrapped in the usual module
+ * init sequence, and fed in randomly-sized spans as they arrive from the
+ * data ring.
+ *
+ * FF OSD bitmap uploads (OSD_BLIT) must reach the bitmap only when their
+ * transaction commits, and not at all if it is dropped.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdio.h>
+#include "../src/i2c.c"
+
+#define W 128
+
+struct image {
+    unsigned int w, h;
+    uint8_t px[64][W];
+};
+
+static struct image golden64, golden32;
+static unsigned int failures;
+
+static uint32_t rnd_state = 1;
+static uint32_t rnd(void)
+{
+    /* xorshift32 */
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+/* Load a plain (P1) PBM file. */
+static void pbm_load(struct image *im, const char *name)
+{
+    char line[256], *p;
+    unsigned int x = 0, y = 0, hdr = 0, v[2];
+    FILE *f = fopen(name, "r");
+
+    if (!f) {
+        printf("%s: cannot open\n", name);
+        failures++;
+        return;
+    }
+    memset(im, 0, sizeof(*im));
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#')
+            continue;
+        if (hdr == 0) {
+            hdr++; /* P1 */
+            continue;
+        }
+        if (hdr == 1) {
+            sscanf(line, "%u %u", &v[0], &v[1]);
+            im->w = v[0];
+            im->h = v[1];
+            hdr++;
+            continue;
+        }
+        for (p = line; *p; p++) {
+            if ((*p != '0') && (*p != '1'))
+                continue;
+            im->px[y][x] = *p - '0';
+            if (++x == im->w) {
+                x = 0;
+                y++;
+            }
+        }
+    }
+    fclose(f);
+}
+
+/* Reset the emulation to power-on state. */
+static void oled_reset(void)
+{
+    memset(&oled, 0, sizeof(oled));
+    memset(oled_ram, 0, sizeof(oled_ram));
+    memset(oled_dirty, 0, sizeof(oled_dirty));
+    memset(i2c_bitmap, 0, sizeof(i2c_bitmap));
+    memset(&i2c_display, 0, sizeof(i2c_display));
+    oled_init();
+}
+
+/* One I2C transaction: Its data arrives in randomly-sized spans, and the
+ * main loop flushes to the bitmap after each. */
+static void xfer(const uint8_t *p, unsigned int n)
+{
+    unsigned int span;
+
+    oled.ctl = TRUE;
+    while (n) {
+        span = min_t(unsigned int, n, 1 + rnd() % 40);
+        oled_process(p, span);
+        p += span;
+        n -= span;
+        if (!(rnd() & 3))
+            oled_flush();
+    }
+    oled_flush();
+}
+
+/* A command transaction: Co=0, D/C#=0, then the command bytes. Or each
+ * command byte with its own control byte (Co=1), as some hosts send. */
+static void cmds(const uint8_t *c, unsigned int n, bool_t single)
+{
+    uint8_t buf[64];
+    unsigned int i, j = 0;
+
+    if (!single) {
+        buf[j++] = 0x00;
+        for (i = 0; i < n; i++)
+            buf[j++] = c[i];
+    } else {
+        for (i = 0; i < n; i++) {
+            buf[j++] = 0x80;
+            buf[j++] = c[i];
+        }
+    }
+    xfer(buf, j);
+}
+
+/* Usual module init: 128x64 or 128x32, segment remap, COM scan
+ * decrement, horizontal addressing. */
+static void oled_module_init(unsigned int h, bool_t single)
+{
+    const uint8_t init[] = {
+        0xae, 0xd5, 0x80, 0xa8, h-1, 0xd3, 0x00, 0x40, 0x8d, 0x14,
+        0x20, 0x00, 0xa1, 0xc8, 0xda, (h == 64) ? 0x12 : 0x02,
+        0x81, 0xcf, 0xd9, 0xf1, 0xdb, 0x40, 0xa4, 0xa6, 0xaf
+    };
+    cmds(init, sizeof(init), single);
+}
+
+/* GDDRAM byte for page @p, column @c of an upright image. */
+static uint8_t gddram(const struct image *im, unsigned int p, unsigned int c)
+{
+    unsigned int r;
+    uint8_t b = 0;
+
+    for (r = 0; r < 8; r++)
+        if ((8*p + r < im->h) && im->px[8*p + r][c])
+            b |= 1u << r;
+    return b;
+}
+
+/* Send GDDRAM data for pages @p0-@p1, columns @c0-@c1, in the current
+ * addressing mode (@vertical: column by column). Data transactions are
+ * @chunk bytes. */
+static void send_data(const struct image *im, unsigned int p0,
+                      unsigned int p1, unsigned int c0, unsigned int c1,
+                      bool_t vertical, unsigned int chunk)
+{
+    uint8_t buf[W*8+1];
+    unsigned int p, c, n = 0, i;
+
+    if (vertical) {
+        for (c = c0; c <= c1; c++)
+            for (p = p0; p <= p1; p++)
+                buf[n++] = gddram(im, p, c);
+    } else {
+        for (p = p0; p <= p1; p++)
+            for (c = c0; c <= c1; c++)
+                buf[n++] = gddram(im, p, c);
+    }
+
+    for (i = 0; i < n; i += chunk) {
+        uint8_t tx[W*8+1];
+        unsigned int m = min_t(unsigned int, chunk, n - i);
+        tx[0] = 0x40;
+        memcpy(&tx[1], &buf[i], m);
+        xfer(tx, m + 1);
+    }
+}
+
+static unsigned int bitmap_px(unsigned int x, unsigned int y)
+{
+    return (i2c_bitmap[y][x/16] >> (15 - (x & 15))) & 1;
+}
+
+/* Compare the emulated bitmap with @expect. Nothing may be drawn beyond
+ * the panel's width or height. */
+static void check(const char *name, const struct image *expect)
+{
+    unsigned int x, y, bad = 0, bad_y = 0;
+
+    for (y = 0; y < BITMAP_HEIGHT; y++) {
+        for (x = 0; x < 16*LINE_WORDS; x++) {
+            unsigned int want = ((y < expect->h) && (x < expect->w))
+                ? expect->px[y][x] : 0;
+            if (bitmap_px(x, y) != want) {
+                if (!bad++)
+                    bad_y = y;
+            }
+        }
+    }
+
+    if (i2c_display.bitmap_height != expect->h) {
+        printf("FAIL %s: bitmap height %u, expected %u\n", name,
+               i2c_display.bitmap_height, expect->h);
+        failures++;
+    }
+
+    if (!bad) {
+        printf("PASS %s\n", name);
+        return;
+    }
+
+    printf("FAIL %s: %u pixels differ, first in line %u\n", name, bad, bad_y);
+    for (y = bad_y; (y < bad_y + 4) && (y < expect->h); y++) {
+        printf(" got  ");
+        for (x = 0; x < W; x++)
+            putchar(bitmap_px(x, y) ? '#' : '.');
+        printf("\n want ");
+        for (x = 0; x < W; x++)
+            putchar(expect->px[y][x] ? '#' : '.');
+        putchar('\n');
+    }
+    failures++;
+}
+
+static void rotate180(struct image *out, const struct image *in)
+{
+    unsigned int x, y;
+
+    *out = *in;
+    for (y = 0; y < in->h; y++)
+        for (x = 0; x < in->w; x++)
+            out->px[in->h-1-y][in->w-1-x] = in->px[y][x];
+}
+
+static void invert(struct image *out, const struct image *in)
+{
+    unsigned int x, y;
+
+    *out = *in;
+    for (y = 0; y < in->h; y++)
+        for (x = 0; x < in->w; x++)
+            out->px[y][x] = !in->px[y][x];
+}
+
+/* Full frame, horizontal addressing, as most hosts refresh. */
+static void test_horizontal(const struct image *im, bool_t single)
+{
+    const uint8_t win[] = { 0x21, 0, W-1, 0x22, 0, im->h/8-1 };
+
+    oled_reset();
+    oled_module_init(im->h, single);
+    cmds(win, sizeof(win), FALSE);
+    send_data(im, 0, im->h/8-1, 0, W-1, FALSE, 32);
+    check((im->h == 64) ? (single ? "horizontal 128x64, Co=1 init"
+                           : "horizontal 128x64")
+          : "horizontal 128x32", im);
+}
+
+/* Page addressing: Each page is addressed with B0+p and the column nibbles.
+ * Data wraps within the page. */
+static void test_page(const struct image *im)
+{
+    const uint8_t mode[] = { 0x20, 0x02 };
+    unsigned int p;
+
+    oled_reset();
+    oled_module_init(im->h, FALSE);
+    cmds(mode, sizeof(mode), FALSE);
+    for (p = 0; p < im->h/8; p++) {
+        uint8_t pg[] = { 0xb0 + p, 0x00, 0x10 };
+        cmds(pg, sizeof(pg), FALSE);
+        send_data(im, p, p, 0, W-1, FALSE, 129);
+    }
+    check("page addressing", im);
+}
+
+/* Vertical addressing: Column by column. */
+static void test_vertical(const struct image *im)
+{
+    const uint8_t cmd[] = { 0x20, 0x01, 0x21, 0, W-1, 0x22, 0, 7 };
+
+    oled_reset();
+    oled_module_init(im->h, FALSE);
+    cmds(cmd, sizeof(cmd), FALSE);
+    send_data(im, 0, 7, 0, W-1, TRUE, 16);
+    check("vertical addressing", im);
+}
+
+/* A windowed update on top of a full frame: Only the window changes. */
+static void test_window(const struct image *im)
+{
+    const uint8_t win[] = { 0x21, 0, W-1, 0x22, 0, 7 };
+    const uint8_t sub[] = { 0x21, 36, 67, 0x22, 2, 4 };
+    struct image inv, expect;
+    unsigned int x, y;
+
+    invert(&inv, im);
+    expect = *im;
+    for (y = 16; y < 40; y++)
+        for (x = 36; x <= 67; x++)
+            expect.px[y][x] = inv.px[y][x];
+
+    oled_reset();
+    oled_module_init(im->h, FALSE);
+    cmds(win, sizeof(win), FALSE);
+    send_data(im, 0, 7, 0, W-1, FALSE, 32);
+    cmds(sub, sizeof(sub), FALSE);
+    send_data(&inv, 2, 4, 36, 67, FALSE, 7);
+    check("windowed update", &expect);
+}
+
+/* Without segment remap and COM scan decrement, the panel shows GDDRAM
+ * rotated by 180 degrees. */
+static void test_rotated(const struct image *im)
+{
+    const uint8_t cmd[] = { 0xa0, 0xc0, 0x21, 0, W-1, 0x22, 0, 7 };
+    struct image expect;
+
+    rotate180(&expect, im);
+    oled_reset();
+    oled_module_init(im->h, FALSE);
+    cmds(cmd, sizeof(cmd), FALSE);
+    send_data(im, 0, 7, 0, W-1, FALSE, 32);
+    check("no remap (rotated 180)", &expect);
+}
+
+static void test_inverse(const struct image *im)
+{
+    const uint8_t cmd[] = { 0xa7, 0x21, 0, W-1, 0x22, 0, 7 };
+    struct image expect;
+
+    invert(&expect, im);
+    oled_reset();
+    oled_module_init(im->h, FALSE);
+    cmds(cmd, sizeof(cmd), FALSE);
+    send_data(im, 0, 7, 0, W-1, FALSE, 32);
+    check("inverse display", &expect);
+}
+
+/* FF OSD: Blit a @w x @h rectangle of byte @b at byte column @x, line @y,
+ * in a bitmap of @h lines. The transaction is left uncommitted. */
+static void blit(uint8_t x, uint8_t y, uint8_t w, uint8_t h, uint8_t b)
+{
+    uint8_t buf[8 + 64];
+    unsigned int i, n = 0;
+
+    buf[n++] = OSD_BITMAP;
+    buf[n++] = 32;
+    buf[n++] = OSD_BLIT;
+    buf[n++] = x;
+    buf[n++] = y;
+    buf[n++] = w;
+    buf[n++] = h;
+    for (i = 0; i < w*h; i++)
+        buf[n++] = b;
+    ff_osd_start();
+    ff_osd_process(buf, n);
+}
+
+static void blit_expect(struct image *im, unsigned int x, unsigned int y,
+                        unsigned int w, unsigned int h, uint8_t b)
+{
+    unsigned int i, j;
+
+    im->w = W;
+    im->h = 32;
+    for (i = y; i < y+h; i++)
+        for (j = 8*x; j < 8*(x+w); j++)
+            im->px[i][j] = (b >> (7 - (j & 7))) & 1;
+}
+
+static void test_blit(void)
+{
+    static struct image none, im;
+
+    memset(i2c_bitmap, 0, sizeof(i2c_bitmap));
+    memset(&i2c_display, 0, sizeof(i2c_display));
+    memset(&ff_osd_stage, 0, sizeof(ff_osd_stage));
+    memset(&ff_osd_committed, 0, sizeof(ff_osd_committed));
+
+    /* Nothing is drawn until the transaction commits. */
+    blit(1, 2, 3, 4, 0xf0);
+    none.w = W;
+    check("FF OSD blit, uncommitted", &none);
+    ff_osd_commit();
+    blit_expect(&im, 1, 2, 3, 4, 0xf0);
+    check("FF OSD blit, committed", &im);
+
+    /* A dropped blit leaves no trace, even in lines staged again by the
+     * next transaction. */
+    blit(0, 4, 5, 6, 0x55);
+    ff_osd_drop();
+    check("FF OSD blit, dropped", &im);
+    blit(4, 5, 1, 1, 0x81);
+    ff_osd_commit();
+    blit_expect(&im, 4, 5, 1, 1, 0x81);
+    check("FF OSD blit after drop", &im);
+}
+
+/* transpose8() against a bit-by-bit transpose. */
+static void test_transpose8(void)
+{
+    uint8_t in[8], out[8], ref[8];
+    unsigned int n, i, j, bad = 0;
+
+    for (n = 0; n < 100000; n++) {
+        for (i = 0; i < 8; i++)
+            in[i] = (n < 64) ? ((n & 7) == i) << (n >> 3) : rnd();
+        memset(ref, 0, sizeof(ref));
+        for (i = 0; i < 8; i++)
+            for (j = 0; j < 8; j++)
+                if (in[i] & (0x80 >> j))
+                    ref[j] |= 0x80 >> i;
+        transpose8(in, out);
+        if (memcmp(out, ref, sizeof(out)))
+            bad++;
+    }
+
+    if (bad) {
+        printf("FAIL transpose8: %u of %u blocks\n", bad, n);
+        failures++;
+    } else {
+        printf("PASS transpose8\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    pbm_load(&golden64, "oled/golden_128x64.pbm");
+    pbm_load(&golden32, "oled/golden_128x32.pbm");
+    if (failures)
+        return 1;
+
+    test_transpose8();
+    test_horizontal(&golden64, FALSE);
+    test_horizontal(&golden64, TRUE);
+    test_horizontal(&golden32, FALSE);
+    test_page(&golden64);
+    test_vertical(&golden64);
+    test_window(&golden64);
+    test_rotated(&golden64);
+    test_inverse(&golden64);
+    test_blit();
+
+    printf("oled_test: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
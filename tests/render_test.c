@@ -0,0 +1,286 @@
+/*
+ * render_test.c
+ *
+ * OSD text rendering: Check render_line() against the original
+ * per-character renderer, and compare their cost per rendered line.
+ * Marquee shifts and CGRAM glyphs, which the original renderer lacks, are
+ * checked on their own.
+ *
+ *  render_test        Check output
+ *  render_test bench  Time both renderers at 16, 20 and 40 columns
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdio.h>
+#include "../src/font.h"
+
+static unsigned int failures;
+
+static uint32_t rnd_state = 1;
+static uint32_t rnd(void)
+{
+    /* xorshift32 */
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+/* The original renderer: Clamp, subtract and shift per character, OR-ing
+ * into a cleared line. */
+static void render_line_old(uint16_t *d, int y, const struct display *display)
+{
+    unsigned int x, row;
+    const uint8_t *t;
+
+    memset(d, 0, LINE_WORDS*sizeof(*d));
+
+    /* Top two lines are blank. */
+    y -= 2;
+
+    /* Work out which text row we are on. */
+    for (row = 0; row < display->rows; row++) {
+        int nr = (display->heights & (1u<<row)) ? 16 : 8;
+        if (y < 0)
+            return;
+        if (y < nr)
+            break;
+        y -= nr + 2; /* Two blank lines between each row of text. */
+    }
+
+    /* Done all rows? Final two lines are blank. */
+    if (row >= display->rows)
+        return;
+
+    /* If this is a double-height row, each pixel line is repeated. */
+    if (display->heights & (1u<<row))
+        y /= 2;
+
+    t = display->text[row];
+
+    for (x = 0; x < display->cols; x++) {
+        uint8_t c = *t++;
+        if ((c < 0x20) || (c > 0x7f))
+            c = 0x20;
+        c -= 0x20;
+        d[x/2] |= (uint16_t)font[(c<<3)+y] << ((x&1)?0:8);
+    }
+}
+
+/* Height in pixel lines of @d, including blank lines above and below. */
+static int display_lines(const struct display *d)
+{
+    int row, h = 2;
+
+    for (row = 0; row < d->rows; row++)
+        h += ((d->heights & (1u<<row)) ? 16 : 8) + 2;
+    return h;
+}
+
+static void random_display(struct display *d)
+{
+    unsigned int row, x;
+
+    memset(d, 0, sizeof(*d));
+    d->rows = 1 + rnd() % 4;
+    d->cols = 1 + rnd() % 40;
+    d->heights = rnd() & 15;
+    for (row = 0; row < 4; row++)
+        for (x = 0; x < 40; x++)
+            d->text[row][x] = rnd(); /* including unprintables */
+}
+
+/* Every pixel line of random layouts, without user glyphs or marquee
+ * (which the original renderer does not support). */
+static void test_equivalence(void)
+{
+    struct display d;
+    uint16_t new[LINE_WORDS], old[LINE_WORDS];
+    unsigned int n, x;
+    int y;
+
+    for (n = 0; n < 20000; n++) {
+        random_display(&d);
+        for (y = 0; y < display_lines(&d) + 2; y++) {
+            memset(new, 0xaa, sizeof(new));
+            render_line(new, y, &d);
+            render_line_old(old, y, &d);
+            for (x = 0; (x < LINE_WORDS) && (new[x] == old[x]); x++)
+                continue;
+            if (x == LINE_WORDS)
+                continue;
+            printf("FAIL equivalence: %d rows, %d cols, heights %x, line %d: "
+                   "word %u is %04x, expected %04x\n", d.rows, d.cols,
+                   d.heights, y, x, new[x], old[x]);
+            failures++;
+            return;
+        }
+    }
+
+    printf("PASS equivalence\n");
+}
+
+static unsigned int pixel(const uint16_t *d, unsigned int px)
+{
+    return (d[px/16] >> (15 - px%16)) & 1;
+}
+
+/* A marquee row shifted by @s pixels is the unshifted row, @s pixels left,
+ * drawing in from the character that follows the last column. */
+static void test_marquee(void)
+{
+    struct display d;
+    uint16_t shifted[LINE_WORDS], next[LINE_WORDS];
+    unsigned int n, s, px, src, cols, nc, want;
+    int y;
+
+    for (n = 0; n < 20000; n++) {
+        random_display(&d);
+        d.rows = 1;
+        d.heights = 0;
+        cols = d.cols;
+        s = 1 + rnd() % 7;
+        y = 2 + rnd() % 8;
+
+        /* Reference: Unshifted, one more column. */
+        nc = min_t(unsigned int, cols + 1, 40);
+        d.cols = nc;
+        render_line(next, y, &d);
+
+        d.cols = cols;
+        d.shift[0] = s;
+        render_line(shifted, y, &d);
+
+        for (px = 0; px < 16*LINE_WORDS; px++) {
+            src = px + s;
+            want = ((px < 8*cols) && (src < 8*nc)) ? pixel(next, src) : 0;
+            if (pixel(shifted, px) == want)
+                continue;
+            printf("FAIL marquee: %u cols, shift %u, line %d: pixel %u "
+                   "is %u\n", cols, s, y, px, !want);
+            failures++;
+            return;
+        }
+    }
+
+    printf("PASS marquee\n");
+}
+
+/* CGRAM glyphs render at codes 0x00-0x0f only on displays which use them:
+ * Elsewhere those codes are blank. */
+static void test_user_glyphs(void)
+{
+    struct display d;
+    uint16_t line[LINE_WORDS];
+    unsigned int g, y;
+
+    for (g = 0; g < 8; g++)
+        for (y = 0; y < 8; y++)
+            font_write_cgram(g*8 + y, (g << 2) | (y & 3) | 0xe0);
+
+    memset(&d, 0, sizeof(d));
+    d.rows = 1;
+    d.cols = 16;
+    for (g = 0; g < 16; g++)
+        d.text[0][g] = g;
+
+    for (y = 0; y < 8; y++) {
+        d.user_glyphs = TRUE;
+        render_line(line, 2 + y, &d);
+        for (g = 0; g < 16; g++) {
+            uint8_t want = (((g & 7) << 2) | (y & 3)) << 2;
+            uint8_t got = line[g/2] >> ((g & 1) ? 0 : 8);
+            if (got != want) {
+                printf("FAIL user glyphs: code %u line %u is %02x, "
+                       "expected %02x\n", g, y, got, want);
+                failures++;
+                return;
+            }
+        }
+        d.user_glyphs = FALSE;
+        render_line(line, 2 + y, &d);
+        for (g = 0; g < LINE_WORDS; g++) {
+            if (line[g] != 0) {
+                printf("FAIL user glyphs: drawn without user_glyphs\n");
+                failures++;
+                return;
+            }
+        }
+    }
+
+    printf("PASS user glyphs\n");
+}
+
+/* Render @lines pixel lines of @d with @fn, cycling through the text rows.
+ * Returns a checksum, so the work is not optimised away. */
+static uint32_t bench_one(void (*fn)(uint16_t *, int, const struct display *),
+                          const struct display *d, unsigned int lines,
+                          uint64_t *ns, uint64_t *cycles)
+{
+    uint16_t buf[LINE_WORDS];
+    uint32_t sum = 0;
+    unsigned int i;
+    uint64_t t, c;
+
+    t = host_ns();
+    c = host_cycles();
+    for (i = 0; i < lines; i++) {
+        fn(buf, 2 + (i & 7), d);
+        sum += buf[i % LINE_WORDS];
+    }
+    *cycles = host_cycles() - c;
+    *ns = host_ns() - t;
+    return sum;
+}
+
+static void bench(void)
+{
+    const unsigned int cols[] = { 16, 20, 40 }, lines = 10000000;
+    struct display d;
+    unsigned int i, x;
+    uint64_t ns[2], cyc[2];
+    static volatile uint32_t sum;
+
+    for (i = 0; i < ARRAY_SIZE(cols); i++) {
+        memset(&d, 0, sizeof(d));
+        d.rows = 2;
+        d.cols = cols[i];
+        for (x = 0; x < 40; x++)
+            d.text[0][x] = d.text[1][x] = 0x20 + rnd() % 0x60;
+        sum += bench_one(render_line_old, &d, lines, &ns[0], &cyc[0]);
+        sum += bench_one(render_line, &d, lines, &ns[1], &cyc[1]);
+        printf("render bench: %2u cols: old %6.1f cycles/line, "
+               "new %6.1f cycles/line (%.2fx), %.1f ns/line\n", cols[i],
+               (double)cyc[0] / lines, (double)cyc[1] / lines,
+               (double)cyc[0] / cyc[1], (double)ns[1] / lines);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    font_init();
+
+    if ((argc > 1) && !strcmp(argv[1], "bench")) {
+        bench();
+        return 0;
+    }
+
+    test_equivalence();
+    test_marquee();
+    test_user_glyphs();
+
+    printf("render_test: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,259 @@
+/*
+ * ring_test.c
+ *
+ * SPSC ring: Stress test and throughput benchmark.
+ *
+ * Producer and consumer share a single core, so the stress test interleaves
+ * them as an IRQ would: Producer bursts are injected at every point in the
+ * consumer's peek/copy/commit sequence. The free-running indices are taken
+ * through many 16-bit wraps. Data order, occupancy, high watermark and
+ * overflow counts are checked against a simple model.
+ *
+ *  ring_test          Run the stress test
+ *  ring_test bench    Run the throughput benchmark
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdio.h>
+
+static unsigned int failures;
+
+#define check(p, fmt, a...) do {                        \
+    if (!(p)) {                                         \
+        printf("FAIL %s:%d: " fmt "\n", __func__, __LINE__, ## a);  \
+        failures++;                                     \
+        return;                                         \
+    }                                                   \
+} while (0)
+
+static uint32_t rnd_state = 1;
+static uint32_t rnd(void)
+{
+    /* xorshift32 */
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+/* Ring under test, and the model of its contents. */
+static uint32_t buf[64];
+static struct ring ring = RING_INIT(buf);
+static uint32_t prod_seq, cons_seq;
+static unsigned int model_hwm, model_overflows;
+
+static void ring_reset(void)
+{
+    memset(&ring, 0, sizeof(ring));
+    ring.size = ARRAY_SIZE(buf);
+    /* Start just short of the 16-bit wrap. */
+    ring.prod = ring.cons = 0x10000 - 3*ARRAY_SIZE(buf) - 5;
+    prod_seq = cons_seq = 0;
+    model_hwm = model_overflows = 0;
+}
+
+static void model_update(void)
+{
+    unsigned int used = prod_seq - cons_seq;
+    if (used > model_hwm)
+        model_hwm = used;
+}
+
+/* Producer ("IRQ"): Push a burst of up to @n elements, either by bulk copy
+ * or in place by reserve/commit. A full ring drops the excess. */
+static void produce(unsigned int n)
+{
+    uint32_t src[ARRAY_SIZE(buf) * 2];
+    unsigned int i, idx, nr, done = 0;
+
+    if (rnd() & 1) {
+        for (i = 0; i < n; i++)
+            src[i] = prod_seq + i;
+        done = ring_push(&ring, buf, src, n);
+        model_overflows += n - done;
+    } else {
+        while ((done < n) && ((nr = ring_reserve(&ring, &idx)) != 0)) {
+            nr = min_t(unsigned int, nr, n - done);
+            for (i = 0; i < nr; i++)
+                buf[idx + i] = prod_seq + done + i;
+            ring_push_commit(&ring, nr);
+            done += nr;
+        }
+    }
+    prod_seq += done;
+    model_update();
+}
+
+/* Maybe take an interrupt here. */
+static void irq_point(void)
+{
+    if (!(rnd() % 3))
+        produce(rnd() % (ARRAY_SIZE(buf) / 2 + 8));
+}
+
+/* Consumer: Bulk pop, or zero-copy peek/commit with producer bursts
+ * between each step. */
+static void consume(void)
+{
+    uint32_t dst[ARRAY_SIZE(buf)];
+    unsigned int i, idx, n, want = 1 + rnd() % ARRAY_SIZE(buf);
+
+    if (rnd() & 1) {
+        n = ring_pop(&ring, buf, dst, want);
+        for (i = 0; i < n; i++) {
+            check(dst[i] == cons_seq, "pop: got %u expected %u",
+                  dst[i], cons_seq);
+            cons_seq++;
+        }
+        return;
+    }
+
+    n = ring_peek(&ring, &idx);
+    irq_point();
+    check(n <= ring_used(&ring), "peek: span %u > used %u",
+          n, ring_used(&ring));
+    check(idx + n <= ring.size, "peek: span %u+%u beyond end", idx, n);
+    n = min_t(unsigned int, n, want);
+    for (i = 0; i < n; i++) {
+        check(buf[idx + i] == cons_seq, "peek: got %u expected %u",
+              buf[idx + i], cons_seq);
+        cons_seq++;
+        irq_point();
+    }
+    ring_pop_commit(&ring, n);
+}
+
+static void test_interleave(void)
+{
+    unsigned int iter;
+
+    ring_reset();
+    for (iter = 0; iter < 2000000; iter++) {
+        irq_point();
+        consume();
+        if (failures)
+            return;
+        check(ring_used(&ring) == prod_seq - cons_seq,
+              "used %u, model %u", ring_used(&ring), prod_seq - cons_seq);
+        check(ring_used(&ring) + ring_space(&ring) == ring.size,
+              "used %u + space %u", ring_used(&ring), ring_space(&ring));
+    }
+
+    check(prod_seq > 50 * 0x10000u, "only %u elements", prod_seq);
+    check(ring.hwm == model_hwm, "hwm %u, model %u", ring.hwm, model_hwm);
+    check(ring.hwm == ring.size, "hwm %u never reached full", ring.hwm);
+    check(ring.overflows == model_overflows, "overflows %u, model %u",
+          ring.overflows, model_overflows);
+    check(model_overflows != 0, "ring never overflowed");
+
+    printf("PASS interleave: %u elements, %u dropped, hwm %u\n",
+           prod_seq, ring.overflows, ring.hwm);
+}
+
+/* A producer which cannot wait (eg. DMA) overruns the consumer: Everything
+ * beyond a full ring is counted, and the watermark saturates. */
+static void test_overrun(void)
+{
+    unsigned int i, idx;
+
+    ring_reset();
+    for (i = 0; i < 10; i++) {
+        ring_push_commit(&ring, 10);
+        check(ring.hwm == min_t(unsigned int, 10*(i+1), ring.size),
+              "hwm %u after %u", ring.hwm, 10*(i+1));
+    }
+    check(ring.overflows == 100 - ring.size, "overflows %u", ring.overflows);
+
+    /* Consumer resyncs to the producer. */
+    ring_pop_commit(&ring, ring_used(&ring));
+    check(ring_used(&ring) == 0, "used %u after resync", ring_used(&ring));
+    check(ring_reserve(&ring, &idx) != 0, "no space after resync");
+
+    /* A single commit which overruns by less than its own length. */
+    ring_push_commit(&ring, ring.size - 1);
+    ring_push_commit(&ring, 3);
+    check(ring.overflows == 100 - ring.size + 2, "overflows %u",
+          ring.overflows);
+
+    printf("PASS overrun\n");
+}
+
+/* Element sizes other than a word, and spans split at the array end. */
+static void test_bytes(void)
+{
+    static uint8_t b[16];
+    static struct ring r = RING_INIT(b);
+    uint8_t in[16], out[16];
+    unsigned int i, j, n, seq_in = 0, seq_out = 0;
+
+    r.prod = r.cons = 0xfff9;
+    for (i = 0; i < 100000; i++) {
+        n = rnd() % 17;
+        for (j = 0; j < n; j++)
+            in[j] = seq_in + j;
+        seq_in += ring_push(&r, b, in, n);
+        n = ring_pop(&r, b, out, rnd() % 17);
+        for (j = 0; j < n; j++, seq_out++)
+            check(out[j] == (uint8_t)seq_out, "got %u expected %u",
+                  out[j], (uint8_t)seq_out);
+    }
+
+    printf("PASS bytes\n");
+}
+
+/* Throughput of bulk push/pop at various burst sizes, through a ring the
+ * size of the console's. */
+static void bench(void)
+{
+    static uint8_t b[2048];
+    static struct ring r = RING_INIT(b);
+    static uint8_t data[256];
+    const unsigned int bursts[] = { 1, 4, 16, 64, 256 };
+    const unsigned int total = 1u << 27;
+    unsigned int i, j, n;
+    uint64_t t, c;
+
+    for (i = 0; i < ARRAY_SIZE(bursts); i++) {
+        n = bursts[i];
+        t = host_ns();
+        c = host_cycles();
+        for (j = 0; j < total; j += n) {
+            ring_push(&r, b, data, n);
+            ring_pop(&r, b, data, n);
+        }
+        c = host_cycles() - c;
+        t = host_ns() - t;
+        printf("ring bench: burst %3u: %7.1f MB/s, %5.2f ns/byte, "
+               "%5.2f cycles/byte\n", n, (double)total * 1e3 / t,
+               (double)t / total, (double)c / total);
+    }
+
+    check(r.overflows == 0, "overflows %u", r.overflows);
+}
+
+int main(int argc, char **argv)
+{
+    if ((argc > 1) && !strcmp(argv[1], "bench")) {
+        bench();
+        return failures ? 1 : 0;
+    }
+
+    test_interleave();
+    test_overrun();
+    test_bytes();
+
+    printf("ring_test: %s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
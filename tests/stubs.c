@@ -0,0 +1,48 @@
+/*
+ * stubs.c
+ * 
+ * Host stand-ins for firmware symbols which tests link against but do not 
+ * exercise.
+ * 
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include <stdio.h>
+
+/* Not <stdlib.h>: Its time_t clashes with the firmware's. */
+char *getenv(const char *name);
+
+struct config config;
+const char fw_ver[] = "0.0";
+
+/* Firmware log output is only shown with FF_OSD_TEST_VERBOSE. */
+int printk(const char *format, ...)
+{
+    static int verbose = -1;
+    va_list ap;
+    int n;
+
+    if (verbose < 0)
+        verbose = (getenv("FF_OSD_TEST_VERBOSE") != NULL);
+    if (!verbose)
+        return 0;
+    va_start(ap, format);
+    n = vprintf(format, ap);
+    va_end(ap);
+    return n;
+}
+
+void gpio_configure_pin(GPIO gpio, unsigned int pin, unsigned int mode)
+{
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
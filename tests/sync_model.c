@@ -0,0 +1,323 @@
+/*
+ * sync_model.c
+ *
+ * Host model of the sync inputs and the peripherals which src/sync.c
+ * programs. Included by the tests which drive the sync state machine with
+ * synthetic CSYNC (or HSYNC+VSYNC) edge streams.
+ *
+ * The hardware model covers only what the firmware relies on: EXTI pending
+ * bits are set by a selected edge even while masked, and are cleared by
+ * writing 1; TIM1 free-runs at SYSCLK with Ch.1/Ch.2 capturing TI1 edges
+ * (SMS=0), or in External Clock Mode 1 counts TI1FP1 edges (SMS=7) and in
+ * one-pulse mode stops at the update event which sets UIF. The OSD box
+ * itself (main.c) is a box of @height lines from @vstart, which ends the
+ * frame.
+ *
+ * The includer provides model_event(), called at start of frame
+ * (EV_SOF), at vertical start of the OSD box (EV_BOX), and at its end
+ * (EV_EOF).
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+static struct tim host_tim1;
+static struct exti host_exti;
+static struct gpio host_gpioa, host_gpiob;
+static struct dwt host_dwt;
+#define tim1 (&host_tim1)
+#define exti (&host_exti)
+#define gpioa (&host_gpioa)
+#define gpiob (&host_gpiob)
+#define dwt (&host_dwt)
+#include "../src/sync.c"
+
+uint16_t running_polarity, detected_polarity;
+uint16_t running_display_timing;
+volatile unsigned int vstart;
+
+#define EV_SOF 0
+#define EV_BOX 1
+#define EV_EOF 2
+static void model_event(int ev);
+
+/* Model parameters. */
+static struct {
+    bool_t lc_keeps_pr;     /* Mutation: IRQ_line_count leaves EXTI PR */
+    uint32_t lc_latency;    /* IRQ_line_count entry latency, ticks */
+} param;
+
+/* Hardware state which is not a plain register. */
+static struct {
+    uint32_t exti_pr;       /* pending bits (host_exti.pr takes writes) */
+    bool_t csync, vsync;    /* pin levels */
+    bool_t lc_pending;      /* TIM1 UEV IRQ raised... */
+    uint64_t lc_time;       /* ...at this time */
+    uint64_t tim_time;      /* time of host_tim1.cnt */
+} hw;
+
+/* OSD box height. */
+static unsigned int height;
+
+/* Sync edges and IRQs so far. */
+static uint64_t edge_idx;
+static unsigned int csync_irqs, lc_irqs;
+
+/* OSD: The box is not generated. */
+void slave_arr_update(void)
+{
+}
+
+static void box_line(void)
+{
+    if (hline == vstart)
+        model_event(EV_BOX);
+    if (hline >= (vstart + height)) {
+        model_event(EV_EOF);
+        sync_frame_end();
+    }
+}
+
+/* TIM1 free-runs at SYSCLK in slave mode 0. */
+static void tim_advance(uint64_t t)
+{
+    if ((host_tim1.cr1 & TIM_CR1_CEN) && !(host_tim1.smcr & 7))
+        host_tim1.cnt = (uint16_t)(host_tim1.cnt + t - hw.tim_time);
+    hw.tim_time = t;
+}
+
+/* Firmware entry at time @t: Registers read by the firmware are brought up
+ * to date, and registers written by it take effect on return. */
+static void fw_enter(uint64_t t)
+{
+    tim_advance(t);
+    host_dwt.cyccnt = t;
+    host_gpioa.idr = hw.csync << pin_csync;
+    host_gpiob.idr = hw.vsync << pin_vsync;
+    host_exti.pr = 0;
+}
+
+static void fw_exit(bool_t keep_pr)
+{
+    if (!keep_pr)
+        hw.exti_pr &= ~host_exti.pr;
+    host_exti.pr = 0;
+}
+
+static void IRQ_csync(uint64_t t)
+{
+    int prev = hline;
+
+    csync_irqs++;
+    fw_enter(t);
+    if (sync_csync())
+        box_line();
+    fw_exit(FALSE);
+
+    if ((hline == HLINE_SOF) && (prev != HLINE_SOF))
+        model_event(EV_SOF);
+}
+
+static void IRQ_vsync(uint64_t t)
+{
+    fw_enter(t);
+    sync_vsync();
+    fw_exit(FALSE);
+}
+
+static void IRQ_line_count(uint64_t t)
+{
+    lc_irqs++;
+    hw.lc_pending = FALSE;
+    fw_enter(t);
+    sync_line_count();
+    fw_exit(param.lc_keeps_pr);
+}
+
+/* Take IRQ_line_count if it has come due by time @t. */
+static void lc_due(uint64_t t, bool_t inclusive)
+{
+    uint64_t due = hw.lc_time + param.lc_latency;
+    if (hw.lc_pending && (host_tim1.dier & TIM_DIER_UIE)
+        && (inclusive ? (due <= t) : (due < t)))
+        IRQ_line_count(due);
+}
+
+/* EXTI: An edge on @pin sets its pending bit if selected. */
+static void exti_edge(unsigned int pin, bool_t rising)
+{
+    if ((rising ? host_exti.rtsr : host_exti.ftsr) & m(pin))
+        hw.exti_pr |= m(pin);
+}
+
+static bool_t exti_irq(unsigned int pin)
+{
+    return !!(hw.exti_pr & host_exti.imr & m(pin));
+}
+
+/* A CSYNC edge at time @t, to level @level. */
+static void csync_edge(uint64_t t, bool_t level)
+{
+    bool_t rising = level;
+
+    /* Anything which came due before this edge. */
+    lc_due(t, FALSE);
+
+    edge_idx++;
+    hw.csync = level;
+    tim_advance(t);
+
+    /* TIM1 Ch.1 and Ch.2 capture TI1 edges of their selected polarity. */
+    if ((host_tim1.ccer & TIM_CCER_CC1E)
+        && (rising == !(host_tim1.ccer & TIM_CCER_CC1P)))
+        host_tim1.ccr1 = host_tim1.cnt;
+    if ((host_tim1.ccer & TIM_CCER_CC2E)
+        && (rising == !(host_tim1.ccer & TIM_CCER_CC2P)))
+        host_tim1.ccr2 = host_tim1.cnt;
+
+    /* External Clock Mode 1: Count TI1FP1 edges, and stop at overflow in
+     * one-pulse mode. */
+    if ((host_tim1.cr1 & TIM_CR1_CEN) && ((host_tim1.smcr & 7) == 7)
+        && (rising == !(host_tim1.ccer & TIM_CCER_CC1P))
+        && (++host_tim1.cnt == 0x10000)) {
+        host_tim1.cnt = 0;
+        host_tim1.sr |= TIM_SR_UIF;
+        if (host_tim1.cr1 & TIM_CR1_OPM)
+            host_tim1.cr1 &= ~TIM_CR1_CEN;
+        hw.lc_pending = TRUE;
+        hw.lc_time = t;
+    }
+
+    exti_edge(pin_csync, rising);
+
+    /* IRQs. */
+    lc_due(t, TRUE);
+    if (exti_irq(pin_csync))
+        IRQ_csync(t);
+}
+
+static void vsync_edge(uint64_t t, bool_t level)
+{
+    hw.vsync = level;
+    exti_edge(pin_vsync, level);
+    lc_due(t, TRUE);
+    if (exti_irq(pin_vsync))
+        IRQ_vsync(t);
+}
+
+/* Signal generators: Active-low sync, in SYSCLK ticks. */
+#define LINE_PAL  (SYSCLK / 15625)
+#define LINE_NTSC (SYSCLK / 15734)
+#define LINE_VGA  (SYSCLK / 31469)
+#define SYNC  sysclk_ns(4700)
+#define EQ    sysclk_ns(2350)
+#define BROAD sysclk_ns(27300)
+
+struct signal {
+    const char *name;
+    void (*field)(const struct signal *sig, unsigned int n);
+    uint32_t line;      /* line period */
+    uint16_t lines;     /* whole lines per field */
+    uint8_t eq;         /* pulses per equalising and broad group */
+    bool_t interlaced;  /* fields of @lines and a half */
+};
+
+static uint64_t now;
+
+static void pulse(uint32_t period, uint32_t w)
+{
+    csync_edge(now, 0);
+    csync_edge(now + w, 1);
+    now += period;
+}
+
+/* Composite sync, field @n: Groups of @eq pre-equalising, broad, and
+ * post-equalising pulses half a line apart, then whole lines. The gaps
+ * after the last post-equalising pulse and after the last whole line are
+ * each a half or a whole line (@a and @b half lines), to make up the
+ * field. In an interlaced signal, the gap before vblank alternates between
+ * fields. */
+static void csync_gaps(const struct signal *sig, unsigned int n,
+                       unsigned int *a, unsigned int *b)
+{
+    bool_t odd = (sig->interlaced + 3*sig->eq - 1) & 1; /* sum is odd? */
+
+    if (!sig->interlaced) {
+        *a = 1;
+        *b = odd ? 2 : 1;
+    } else if (odd) {
+        *a = (n & 1) ? 2 : 1;
+        *b = 3 - *a;
+    } else {
+        *a = *b = (n & 1) ? 1 : 2;
+    }
+}
+
+static void csync_field(const struct signal *sig, unsigned int n)
+{
+    uint32_t half = sig->line / 2;
+    unsigned int i, a, b, lines, pulses = 3 * sig->eq;
+
+    csync_gaps(sig, n, &a, &b);
+    lines = (2*sig->lines + sig->interlaced - (pulses - 1) - a - b + 2) / 2;
+
+    for (i = 0; i < pulses; i++)
+        pulse((i < pulses - 1) ? half : a * half,
+              (i / sig->eq == 1) ? BROAD : EQ);
+    for (i = 0; i < lines; i++)
+        pulse((i < lines - 1) ? sig->line : b * half, SYNC);
+}
+
+/* Separate HSYNC and VSYNC: VSYNC is asserted during the first line's
+ * sync pulse, for three lines. */
+static void hvsync_field(const struct signal *sig, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < sig->lines; i++) {
+        csync_edge(now, 0);
+        if ((i == 0) || (i == 3))
+            vsync_edge(now + sysclk_us(1), (i == 3));
+        csync_edge(now + SYNC, 1);
+        now += sig->line;
+    }
+}
+
+/* Power-on state of the sync peripherals and firmware (as main()). */
+static void model_reset(void)
+{
+    memset(&hw, 0, sizeof(hw));
+    hw.csync = hw.vsync = 1;
+    memset(&host_tim1, 0, sizeof(host_tim1));
+    memset(&host_exti, 0, sizeof(host_exti));
+    host_tim1.ccmr1 = TIM_CCMR1_CC1S(TIM_CCS_INPUT_TI1);
+    host_tim1.cr1 = TIM_CR1_ARPE | TIM_CR1_OPM;
+    host_tim1.ccer = TIM_CCER_CC1E;
+    host_exti.imr = m(pin_csync) | m(pin_vsync);
+    edge_idx = 0;
+    csync_irqs = lc_irqs = 0;
+    now = 0;
+
+    running_polarity = detected_polarity = SYNC_LOW;
+    hline = HLINE_EOF;
+    frame = 0;
+    line_count_active = FALSE;
+    sync_capture_active = FALSE;
+    line_period = prev_interval = 0;
+    half_lines = 0;
+    line_grid = odd_field = FALSE;
+    lace = 0;
+    memset(&autosync, 0, sizeof(autosync));
+    set_polarity();
+    sync_capture_start();
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */